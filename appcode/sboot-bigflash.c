@@ -0,0 +1,69 @@
+//////////////////////////////////////////////////
+// sBoot open source boot loader for ESP8266.
+// Copyright 2015-2019 Richard A Burton
+// richardaburton@gmail.com
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// Link this with an sdk based user rom so it can run from either slot.
+// sBoot maps the 1MB flash bank the rom was booted from, but the sdk
+// maps the first bank again when it starts, through this function,
+// so the sdk's own version of it must be weakened, e.g.
+//   xtensa-lx106-elf-objcopy -W Cache_Read_Enable_New libmain.a libmain2.a
+// and link with libmain2 instead. This must be in iram, so don't
+// mark it ICACHE_FLASH_ATTR.
+
+#include <stdint.h>
+#include <sboot.h>
+
+extern uint32_t SPIRead(uint32_t addr, void *outptr, uint32_t len);
+extern void Cache_Read_Enable(uint32_t odd_even, uint32_t mb_count, uint32_t no_idea);
+
+static uint32_t mmap_set = 0;
+static uint32_t mmap_x, mmap_y;
+
+// crc32 of the config fields up to its crc, a bit at a time, as this
+// runs before the sdk, and only once
+static uint32_t config_crc(const boot_config *config) {
+	const uint8_t *data = (const uint8_t*)config;
+	uint32_t crc = 0xffffffff;
+	uint32_t loop, bit;
+	for (loop = 0; loop < (const uint8_t*)&config->crc - data; loop++) {
+		crc ^= data[loop];
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+		}
+	}
+	return crc ^ 0xffffffff;
+}
+
+// true if a copy of the boot config is valid, as sBoot checks it
+static uint32_t config_valid(const boot_config *config) {
+	return (config->magic == BOOT_CONFIG_MAGIC && config->slot < BOOT_SLOTS
+		&& config->crc == config_crc(config));
+}
+
+// map the bank of the slot sBoot booted, from the current copy of the
+// boot config, the valid one with the higher sequence number, or the
+// first bank if neither is valid, as sBoot would boot slot a
+void Cache_Read_Enable_New(void) {
+	if (!mmap_set) {
+		boot_config config, copy;
+		uint32_t bank = BOOT_SLOT_A_OFFSET / 0x100000;
+		uint32_t valid;
+		SPIRead(BOOT_CONFIG_OFFSET, &config, sizeof(config));
+		SPIRead(BOOT_CONFIG_COPY_OFFSET, &copy, sizeof(copy));
+		valid = config_valid(&config);
+		if (config_valid(&copy) && (!valid || (int32_t)(copy.seq - config.seq) > 0)) {
+			config = copy;
+			valid = 1;
+		}
+		if (valid && config.slot == 1) {
+			bank = BOOT_SLOT_B_OFFSET / 0x100000;
+		}
+		mmap_x = bank & 1;
+		mmap_y = (bank >> 1) & 1;
+		mmap_set = 1;
+	}
+	Cache_Read_Enable(mmap_x, mmap_y, 1);
+}
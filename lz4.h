@@ -0,0 +1,103 @@
+//////////////////////////////////////////////////
+// LZ4 frame decoder for sBoot.
+// Copyright 2015-2019 Richard A Burton
+// richardaburton@gmail.com
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+#ifndef LZ4_DECODE_H
+#define LZ4_DECODE_H
+
+#include <stdint.h>
+
+// status codes are shared with uzlib (UZLIB_OK, UZLIB_DONE, etc.)
+#include "uzlib.h"
+
+// lz4 frame magic, and skippable frame magic (low nibble is free)
+#define LZ4_MAGIC           0x184D2204
+#define LZ4_SKIP_MAGIC      0x184D2A50
+#define LZ4_SKIP_MAGIC_MASK 0xFFFFFFF0
+
+// frame descriptor flags
+#define LZ4_FLG_VERSION_MASK 0xC0
+#define LZ4_FLG_VERSION      0x40
+#define LZ4_FLG_BCHECKSUM    0x10
+#define LZ4_FLG_CSIZE        0x08
+#define LZ4_FLG_CCHECKSUM    0x04
+#define LZ4_FLG_DICTID       0x01
+
+// block size word, high bit set for a stored (uncompressed) block
+#define LZ4_BLOCK_STORED     0x80000000
+
+// size of the decompression window, as a power of 2, lz4 back references
+// reach up to 64k, those further than the window are read back through
+// the history callback (see lz4_decode_set_history), or rejected with
+// UZLIB_DICT_ERROR if there isn't one
+// override on the compiler command line to change
+#ifndef LZ4_WINDOW_BITS
+#define LZ4_WINDOW_BITS 15
+#endif
+
+// decompression state, owned by the caller, includes the
+// window so should be static rather than on the stack
+typedef struct {
+	// word aligned for the crc32
+	uint8_t decomp_buffer[1 << LZ4_WINDOW_BITS] __attribute__ ((aligned (4)));
+	uint32_t decomp_pos;
+	// output before flush_pos has already been passed to put_bytes
+	uint32_t flush_pos;
+
+	uint8_t *source;
+	uint32_t source_len;
+	uint32_t source_pos;
+
+	// methods encapsulate handling of the input and output streams
+	void (*put_bytes)(void*, uint8_t*, uint32_t);
+	uint32_t (*get_bytes)(void*);
+	// optional, reads back output older than the window
+	void (*get_history)(void*, uint32_t, uint8_t*, uint32_t);
+	// user data passed to callbacks
+	void *cb_data;
+
+	// cache of output read back through get_history, and the output
+	// position of its first byte
+	uint8_t hist_cache[UZLIB_HISTORY_CACHE] __attribute__ ((aligned (4)));
+	uint32_t hist_pos;
+
+	// frame descriptor flags
+	uint8_t flags;
+	uint8_t header_done;
+	uint8_t input_end;
+	// compressed bytes left in the current block, and if it is stored
+	uint32_t block_left;
+	uint32_t block_stored;
+
+	uint32_t dest_len;
+	uint32_t checksum;
+} LZ4_DATA;
+
+// step-wise api, with caller owned state, works the same as uzlib's
+// the stream is a single lz4 frame (optionally preceded by skippable
+// frames), followed by a skippable frame of at least 8 bytes starting
+// with the crc32 and length of the decoded data, as a gzip footer
+void lz4_decode_init (LZ4_DATA *d, uint32_t (*)(void *), void (*)(void *, uint8_t *, uint32_t), void *cb_data, uint8_t *);
+int32_t lz4_decode_step (LZ4_DATA *d, uint32_t budget);
+int32_t lz4_decode_finish (LZ4_DATA *d);
+
+// set a callback to read back earlier output, as for uzlib
+void lz4_decode_set_history (LZ4_DATA *d, void (*)(void *, uint32_t, uint8_t *, uint32_t));
+
+// decoder state at a sync point, between blocks, as for uzlib
+typedef struct {
+	uint32_t flags;
+	uint32_t dest_len;
+	uint32_t decomp_pos;
+	uint32_t checksum;
+} LZ4_SYNC;
+
+// save the state at a sync point (steps end at each block boundary),
+// and resume from it later, as uzlib_inflate_sync and resume
+int32_t lz4_decode_sync (LZ4_DATA *d, LZ4_SYNC *s);
+void lz4_decode_resume (LZ4_DATA *d, const LZ4_SYNC *s, void (*)(void *, uint32_t, uint8_t *, uint32_t));
+
+#endif /* LZ4_DECODE_H */
@@ -0,0 +1,343 @@
+//////////////////////////////////////////////////
+// LZ4 frame decoder for sBoot.
+// Copyright 2015-2019 Richard A Burton
+// richardaburton@gmail.com
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+#include "lz4.h"
+
+extern void ets_memcpy(void*, const void*, uint32_t);
+extern void ets_memset(void*, uint8_t, uint32_t);
+
+#define MIN(a,b) ((a)<(b) ? (a):(b))
+
+// minimum match length, added to the length in the token
+#define LZ4_MIN_MATCH 4
+
+////////////////////////////////////////////////////////////////
+/// Input, pulled from get_bytes a buffer at a time.
+///
+
+static uint8_t get_byte(LZ4_DATA *d) {
+	if (d->source_pos == d->source_len) {
+		d->source_len = d->get_bytes(d->cb_data);
+		d->source_pos = 0;
+		if (d->source_len == 0) {
+			d->input_end = 1;
+			return 0;
+		}
+	}
+	return d->source[d->source_pos++];
+}
+
+static uint32_t get_le_uint32(LZ4_DATA *d) {
+	uint32_t val = get_byte(d);
+	val |= get_byte(d) << 8;
+	val |= get_byte(d) << 16;
+	val |= (uint32_t)get_byte(d) << 24;
+	return val;
+}
+
+static void skip_bytes(LZ4_DATA *d, uint32_t len) {
+	while (len-- && !d->input_end) get_byte(d);
+}
+
+// byte from the current block
+static uint8_t block_byte(LZ4_DATA *d) {
+	d->block_left--;
+	return get_byte(d);
+}
+
+// lz4 style length extension, bytes of 255 continue
+static uint32_t get_length(LZ4_DATA *d, uint32_t len) {
+	uint8_t b;
+	do {
+		if (d->block_left == 0) {
+			// runs off the end of the block, treat as truncated
+			d->input_end = 1;
+			return 0;
+		}
+		b = block_byte(d);
+		len += b;
+	} while (b == 255 && !d->input_end);
+	return len;
+}
+
+////////////////////////////////////////////////////////////////
+/// Output, collected in the window and passed to put_bytes
+/// each time it fills up.
+///
+
+// pass on the output not already passed on at a sync point
+static void flush_bytes(LZ4_DATA *d) {
+	uint8_t *data = d->decomp_buffer + d->flush_pos;
+	uint32_t len = d->decomp_pos - d->flush_pos;
+	d->put_bytes(d->cb_data, data, len);
+	d->checksum = uzlib_crc32(data, len, d->checksum);
+	d->flush_pos = d->decomp_pos;
+}
+
+static void push_bytes(LZ4_DATA *d) {
+	flush_bytes(d);
+	d->dest_len += d->decomp_pos;
+	d->decomp_pos = 0;
+	d->flush_pos = 0;
+}
+
+// copy len bytes from the input (literals, or a stored block)
+static void copy_input(LZ4_DATA *d, uint32_t len) {
+	while (len > 0) {
+		uint32_t n;
+		if (d->source_pos == d->source_len) {
+			d->source_len = d->get_bytes(d->cb_data);
+			d->source_pos = 0;
+			if (d->source_len == 0) {
+				d->input_end = 1;
+				return;
+			}
+		}
+		n = MIN(len, d->source_len - d->source_pos);
+		n = MIN(n, sizeof(d->decomp_buffer) - d->decomp_pos);
+		ets_memcpy(d->decomp_buffer + d->decomp_pos, d->source + d->source_pos, n);
+		d->source_pos += n;
+		d->decomp_pos += n;
+		d->block_left -= n;
+		len -= n;
+		if (d->decomp_pos == sizeof(d->decomp_buffer)) push_bytes(d);
+	}
+}
+
+// copy len bytes of a match dist back in the output
+static void copy_match(LZ4_DATA *d, uint32_t dist, uint32_t len) {
+	while (len > 0) {
+		uint8_t *out = d->decomp_buffer + d->decomp_pos;
+		uint32_t n = MIN(len, sizeof(d->decomp_buffer) - d->decomp_pos);
+		if (dist > sizeof(d->decomp_buffer)) {
+			// older than the window, already passed to put_bytes, so read
+			// back, a cache line at a time
+			uint32_t from = d->dest_len + d->decomp_pos - dist;
+			uint32_t line = from & ~(uint32_t)(sizeof(d->hist_cache) - 1);
+			if (line != d->hist_pos) {
+				d->get_history(d->cb_data, line, d->hist_cache, sizeof(d->hist_cache));
+				d->hist_pos = line;
+			}
+			n = MIN(n, line + sizeof(d->hist_cache) - from);
+			ets_memcpy(out, d->hist_cache + (from - line), n);
+		} else {
+			uint8_t *from;
+			uint32_t i;
+			if (dist > d->decomp_pos) {
+				// wraps round the end of the window
+				from = d->decomp_buffer + sizeof(d->decomp_buffer) - (dist - d->decomp_pos);
+				n = MIN(n, dist - d->decomp_pos);
+			} else {
+				from = out - dist;
+			}
+			if (from + n <= out || out + n <= from) {
+				ets_memcpy(out, from, n);
+			} else if (dist == 1) {
+				ets_memset(out, *from, n);
+			} else {
+				// overlapping, repeats the last dist bytes
+				for (i = 0; i < n; i++) out[i] = from[i];
+			}
+		}
+		d->decomp_pos += n;
+		len -= n;
+		if (d->decomp_pos == sizeof(d->decomp_buffer)) push_bytes(d);
+	}
+}
+
+////////////////////////////////////////////////////////////////
+/// Frame and block parsing.
+///
+
+// skip any skippable frames and parse the frame descriptor
+static int32_t parse_frame_header(LZ4_DATA *d) {
+	uint32_t magic;
+	while (((magic = get_le_uint32(d)) & LZ4_SKIP_MAGIC_MASK) == LZ4_SKIP_MAGIC) {
+		skip_bytes(d, get_le_uint32(d));
+		if (d->input_end) return UZLIB_DATA_ERROR;
+	}
+	if (magic != LZ4_MAGIC) return UZLIB_DATA_ERROR;
+
+	d->flags = get_byte(d);
+	if ((d->flags & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION) return UZLIB_DATA_ERROR;
+	// no way to get a preset dictionary
+	if (d->flags & LZ4_FLG_DICTID) return UZLIB_DICT_ERROR;
+	// skip block max size, content size and header checksum, the
+	// decoder streams so doesn't need the sizes
+	skip_bytes(d, (d->flags & LZ4_FLG_CSIZE) ? 10 : 2);
+
+	return d->input_end ? UZLIB_DATA_ERROR : UZLIB_OK;
+}
+
+// start the next block, returns UZLIB_DONE at the end mark
+static int32_t next_block(LZ4_DATA *d) {
+	uint32_t size;
+	if (!d->header_done) {
+		int32_t res = parse_frame_header(d);
+		if (res != UZLIB_OK) return res;
+		d->header_done = 1;
+	} else if (d->flags & LZ4_FLG_BCHECKSUM) {
+		// block checksums are not checked, the crc32 covers the output
+		skip_bytes(d, 4);
+	}
+	size = get_le_uint32(d);
+	if (size == 0) {
+		// end mark, content checksum (xxhash32) is not checked either
+		if (d->flags & LZ4_FLG_CCHECKSUM) skip_bytes(d, 4);
+		return UZLIB_DONE;
+	}
+	d->block_stored = size & LZ4_BLOCK_STORED;
+	d->block_left = size & ~LZ4_BLOCK_STORED;
+	return UZLIB_OK;
+}
+
+// decode one sequence of the current block, literals then a match
+static int32_t decode_sequence(LZ4_DATA *d) {
+	uint8_t token;
+	uint32_t len, dist;
+
+	token = block_byte(d);
+	len = token >> 4;
+	if (len == 15) len = get_length(d, len);
+	if (len > d->block_left) return UZLIB_DATA_ERROR;
+	copy_input(d, len);
+
+	// last sequence of a block has no match
+	if (d->block_left == 0 || d->input_end) return UZLIB_OK;
+	if (d->block_left < 2) return UZLIB_DATA_ERROR;
+	dist = block_byte(d);
+	dist |= block_byte(d) << 8;
+	len = token & 15;
+	if (len == 15) len = get_length(d, len);
+	len += LZ4_MIN_MATCH;
+
+	// check it's within the window and the data produced so far
+	if (dist == 0 || dist > d->dest_len + d->decomp_pos) return UZLIB_DATA_ERROR;
+	if (dist > sizeof(d->decomp_buffer) && !d->get_history) return UZLIB_DICT_ERROR;
+	copy_match(d, dist, len);
+	return UZLIB_OK;
+}
+
+////////////////////////////////////////////////////////////////
+/// Public api.
+///
+
+void lz4_decode_init (
+		LZ4_DATA *d,
+		uint32_t (*get_bytes)(void*),
+		void (*put_bytes)(void *, uint8_t *, uint32_t),
+		void *cb_data,
+		uint8_t *source) {
+	d->get_bytes    = get_bytes;
+	d->put_bytes    = put_bytes;
+	d->get_history  = 0;
+	d->cb_data      = cb_data;
+	d->source       = source;
+	d->source_len   = 0;
+	d->source_pos   = 0;
+	d->decomp_pos   = 0;
+	d->flush_pos    = 0;
+	d->hist_pos     = 0xffffffff;
+	d->flags        = 0;
+	d->header_done  = 0;
+	d->input_end    = 0;
+	d->block_left   = 0;
+	d->block_stored = 0;
+	d->dest_len     = 0;
+	d->checksum     = 0xffffffff;
+}
+
+void lz4_decode_set_history (
+		LZ4_DATA *d,
+		void (*get_history)(void *, uint32_t, uint8_t *, uint32_t)) {
+	d->get_history = get_history;
+	d->hist_pos    = 0xffffffff;
+}
+
+// sync point, between blocks, the state is saved and the output in the
+// window passed on (but kept for later matches)
+int32_t lz4_decode_sync (LZ4_DATA *d, LZ4_SYNC *s) {
+	if (!d->header_done || d->block_left != 0 || d->input_end) return -1;
+	if (d->decomp_pos > d->flush_pos) flush_bytes(d);
+	s->flags      = d->flags;
+	s->dest_len   = d->dest_len;
+	s->decomp_pos = d->decomp_pos;
+	s->checksum   = d->checksum;
+	return d->source_len - d->source_pos;
+}
+
+// carry on from a sync point, the window is refilled from the output a
+// cache line at a time, lines never wrap round the window as dest_len
+// is always a multiple of the window size
+void lz4_decode_resume (
+		LZ4_DATA *d,
+		const LZ4_SYNC *s,
+		void (*get_history)(void *, uint32_t, uint8_t *, uint32_t)) {
+	uint32_t end = s->dest_len + s->decomp_pos;
+	uint32_t pos = (end > sizeof(d->decomp_buffer)) ? end - sizeof(d->decomp_buffer) : 0;
+
+	d->flags       = s->flags;
+	d->dest_len    = s->dest_len;
+	d->decomp_pos  = s->decomp_pos;
+	d->flush_pos   = s->decomp_pos;
+	d->checksum    = s->checksum;
+	d->header_done = 1;
+	d->block_left  = 0;
+	d->source_len  = 0;
+	d->source_pos  = 0;
+
+	while (pos < end) {
+		uint32_t line = pos & ~(uint32_t)(sizeof(d->hist_cache) - 1);
+		uint32_t len = MIN(end - pos, line + sizeof(d->hist_cache) - pos);
+		get_history(d->cb_data, line, d->hist_cache, sizeof(d->hist_cache));
+		ets_memcpy(d->decomp_buffer + (pos % sizeof(d->decomp_buffer)), d->hist_cache + (pos - line), len);
+		pos += len;
+	}
+	d->hist_pos = 0xffffffff;
+}
+
+// decode until at least budget bytes of output have been produced (zero
+// for no limit), or the end of a block, returns UZLIB_OK if there is
+// more to do, UZLIB_DONE at the end of the frame, or an error
+int32_t lz4_decode_step (LZ4_DATA *d, uint32_t budget) {
+	uint32_t target = d->dest_len + d->decomp_pos + budget;
+	int32_t res = UZLIB_OK;
+
+	while (res == UZLIB_OK) {
+		if (d->block_left == 0) {
+			res = next_block(d);
+		} else if (d->block_stored) {
+			copy_input(d, d->block_left);
+		} else {
+			res = decode_sequence(d);
+		}
+		if (d->input_end) return UZLIB_DATA_ERROR;
+		if (budget && d->dest_len + d->decomp_pos >= target) break;
+		// end the step between blocks, where it can be synced
+		if (d->block_left == 0) break;
+	}
+	return res;
+}
+
+// flush any remaining output and check the trailer, call after
+// lz4_decode_step has returned UZLIB_DONE
+int32_t lz4_decode_finish (LZ4_DATA *d) {
+	uint32_t size, crc, len;
+
+	if (d->decomp_pos > 0) push_bytes(d);
+
+	if ((get_le_uint32(d) & LZ4_SKIP_MAGIC_MASK) != LZ4_SKIP_MAGIC) return UZLIB_DATA_ERROR;
+	size = get_le_uint32(d);
+	if (size < 8) return UZLIB_DATA_ERROR;
+	crc = get_le_uint32(d);
+	len = get_le_uint32(d);
+	if (d->input_end) return UZLIB_DATA_ERROR;
+
+	if (crc != (d->checksum ^ 0xffffffff)) return UZLIB_CHKSUM_ERROR;
+	if (len != d->dest_len) return UZLIB_LENGTH_ERROR;
+	return UZLIB_DONE;
+}
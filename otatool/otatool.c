@@ -0,0 +1,391 @@
+//////////////////////////////////////////////////
+// otatool, host side tool to create sBoot ota files.
+// Copyright 2015-2019 Richard A Burton
+// richardaburton@gmail.com
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+#include <sboot-ota.h>
+
+// default deflate window, as a power of 2, must be no bigger
+// than the window sBoot is built with
+#define DEFAULT_WINDOW_BITS 15
+
+// default region size for dictionary compressed roms, half the window
+// so the whole of the matching region of the installed rom is in reach
+#define DEFAULT_REGION_SIZE 0x4000
+
+// flash sector size, manifest data targets must be aligned to it
+#define SECTOR_SIZE 0x1000
+
+// shortest exact match worth a copy op
+#define MIN_COPY 16
+// hashed length, and hash table size, for finding matches
+#define HASH_LEN  8
+#define HASH_BITS 16
+// match candidates checked at each position
+#define MAX_CHAIN 64
+// window checked when deciding if an add op is worthwhile, an add
+// continues while at least half the bytes in the window are the same
+#define ADD_WINDOW 32
+
+typedef struct {
+	uint8_t *data;
+	uint32_t len;
+	uint32_t size;
+} buffer;
+
+static void *xrealloc(void *ptr, size_t size) {
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		printf("Unable to malloc %d bytes.\n", (int)size);
+		exit(EXIT_FAILURE);
+	}
+	return ptr;
+}
+
+static void buffer_add(buffer *buf, const uint8_t *data, uint32_t len) {
+	if (buf->len + len > buf->size) {
+		buf->size = (buf->len + len) * 2;
+		buf->data = xrealloc(buf->data, buf->size);
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void buffer_add_le32(buffer *buf, uint32_t val) {
+	uint8_t le[4] = { val, val >> 8, val >> 16, val >> 24 };
+	buffer_add(buf, le, sizeof(le));
+}
+
+static void read_file(const char *name, buffer *buf) {
+	FILE *f = fopen(name, "rb");
+	uint8_t tmp[4096];
+	size_t len;
+	if (!f) {
+		printf("Unable to open file '%s' for reading.\n", name);
+		exit(EXIT_FAILURE);
+	}
+	while ((len = fread(tmp, 1, sizeof(tmp), f)) > 0) buffer_add(buf, tmp, len);
+	fclose(f);
+}
+
+static void write_file(const char *name, buffer *buf) {
+	FILE *f = fopen(name, "wb");
+	if (!f || fwrite(buf->data, 1, buf->len, f) != buf->len) {
+		printf("Unable to write file '%s'.\n", name);
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+}
+
+static uint32_t rom_crc32(buffer *buf) {
+	return crc32(crc32(0, Z_NULL, 0), buf->data, buf->len);
+}
+
+// gzip (or zlib, with an optional preset dictionary) compress, with the
+// given window size
+static void deflate_add(buffer *out, const uint8_t *data, uint32_t len, int window_bits,
+		int gzip, const uint8_t *dict, uint32_t dict_len) {
+	z_stream strm;
+	uint8_t tmp[4096];
+	int res;
+	memset(&strm, 0, sizeof(strm));
+	if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, window_bits + (gzip ? 16 : 0), 9, Z_DEFAULT_STRATEGY) != Z_OK
+		|| (dict_len && deflateSetDictionary(&strm, dict, dict_len) != Z_OK)) {
+		printf("Unable to init deflate.\n");
+		exit(EXIT_FAILURE);
+	}
+	strm.next_in = (uint8_t *)data;
+	strm.avail_in = len;
+	do {
+		strm.next_out = tmp;
+		strm.avail_out = sizeof(tmp);
+		res = deflate(&strm, Z_FINISH);
+		buffer_add(out, tmp, sizeof(tmp) - strm.avail_out);
+	} while (res == Z_OK);
+	deflateEnd(&strm);
+}
+
+////////////////////////////////////////////////////////////////
+/// Delta patches.
+///
+
+static uint32_t hash(const uint8_t *data) {
+	uint32_t h = 0;
+	int i;
+	for (i = 0; i < HASH_LEN; i++) h = (h * 0x01000193) ^ data[i];
+	return (h ^ (h >> HASH_BITS)) & ((1 << HASH_BITS) - 1);
+}
+
+static void patch_op(buffer *ops, uint8_t op, uint32_t offset, uint32_t len, const uint8_t *data) {
+	buffer_add(ops, &op, 1);
+	if (op == PATCH_OP_END) return;
+	if (op != PATCH_OP_INSERT) buffer_add_le32(ops, offset);
+	buffer_add_le32(ops, len);
+	if (data) buffer_add(ops, data, len);
+}
+
+// work out the ops to turn old into new, greedily using the longest
+// exact match (copy), else an add op continuing from the last match
+// if that is close enough, else inserting new data
+static void make_patch(buffer *old, buffer *new, buffer *ops) {
+	int32_t *head = xrealloc(NULL, sizeof(int32_t) << HASH_BITS);
+	int32_t *chain = xrealloc(NULL, sizeof(int32_t) * (old->len + 1));
+	buffer pending = {0};
+	uint8_t pending_op = PATCH_OP_END;
+	uint32_t pending_offset = 0;
+	// offset from the new rom to the old one at the last match
+	int64_t delta = 0;
+	int have_match = 0;
+	uint32_t pos, i;
+
+	memset(head, 0xff, sizeof(int32_t) << HASH_BITS);
+	for (i = 0; i + HASH_LEN <= old->len; i++) {
+		uint32_t h = hash(old->data + i);
+		chain[i] = head[h];
+		head[h] = i;
+	}
+
+	pos = 0;
+	while (pos < new->len) {
+		uint32_t best_len = 0, best_off = 0;
+		uint8_t op;
+
+		// longest exact match in old
+		if (pos + HASH_LEN <= new->len) {
+			int32_t cand = head[hash(new->data + pos)];
+			int count;
+			for (count = 0; cand >= 0 && count < MAX_CHAIN; count++, cand = chain[cand]) {
+				uint32_t len = 0;
+				while (pos + len < new->len && cand + len < old->len
+					&& new->data[pos + len] == old->data[cand + len]) len++;
+				if (len > best_len) {
+					best_len = len;
+					best_off = cand;
+				}
+			}
+		}
+
+		if (best_len >= MIN_COPY) {
+			op = PATCH_OP_COPY;
+		} else {
+			// does the data still mostly line up with the last match, the
+			// offset can be negative, when data has moved forward
+			uint32_t same = 0, len = 0;
+			if (have_match && delta + pos >= 0) {
+				while (len < ADD_WINDOW && pos + len < new->len && delta + pos + len < old->len) {
+					if (new->data[pos + len] == old->data[delta + pos + len]) same++;
+					len++;
+				}
+			}
+			op = (len == ADD_WINDOW && same * 2 >= ADD_WINDOW) ? PATCH_OP_ADD : PATCH_OP_INSERT;
+		}
+
+		// flush the pending add or insert if this doesn't extend it
+		if (pending_op != PATCH_OP_END && op != pending_op) {
+			patch_op(ops, pending_op, pending_offset, pending.len, pending.data);
+			pending_op = PATCH_OP_END;
+		}
+
+		if (op == PATCH_OP_COPY) {
+			patch_op(ops, op, best_off, best_len, NULL);
+			delta = (int64_t)best_off - pos;
+			have_match = 1;
+			pos += best_len;
+		} else {
+			uint8_t byte = new->data[pos];
+			if (pending_op == PATCH_OP_END) {
+				pending_op = op;
+				pending_offset = delta + pos;
+				pending.len = 0;
+			}
+			if (op == PATCH_OP_ADD) byte -= old->data[delta + pos];
+			buffer_add(&pending, &byte, 1);
+			pos++;
+		}
+	}
+	if (pending_op != PATCH_OP_END) patch_op(ops, pending_op, pending_offset, pending.len, pending.data);
+	patch_op(ops, PATCH_OP_END, 0, 0, NULL);
+
+	free(pending.data);
+	free(chain);
+	free(head);
+}
+
+static int do_patch(const char *oldfile, const char *newfile, const char *outfile, int window_bits) {
+	buffer old = {0}, new = {0}, ops = {0}, out = {0};
+
+	read_file(oldfile, &old);
+	read_file(newfile, &new);
+	make_patch(&old, &new, &ops);
+
+	buffer_add_le32(&out, PATCH_MAGIC);
+	buffer_add_le32(&out, old.len);
+	buffer_add_le32(&out, rom_crc32(&old));
+	deflate_add(&out, ops.data, ops.len, window_bits, 1, NULL, 0);
+	buffer_add_le32(&out, rom_crc32(&new));
+	buffer_add_le32(&out, new.len);
+	write_file(outfile, &out);
+
+	printf("Created patch '%s', %d bytes (new rom %d bytes).\n", outfile, out.len, new.len);
+	return EXIT_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////
+/// Dictionary compressed roms.
+///
+
+static int do_dict(const char *oldfile, const char *newfile, const char *outfile, int window_bits, uint32_t region_size) {
+	buffer old = {0}, new = {0}, out = {0};
+	uint32_t dict_size = 1 << window_bits;
+	uint32_t start = 0;
+
+	read_file(oldfile, &old);
+	read_file(newfile, &new);
+
+	buffer_add_le32(&out, DICT_MAGIC);
+	buffer_add_le32(&out, old.len);
+	buffer_add_le32(&out, rom_crc32(&old));
+	buffer_add_le32(&out, region_size);
+	buffer_add_le32(&out, dict_size);
+	// a stream for each region, at least one even for an empty rom
+	do {
+		uint32_t len = (new.len - start < region_size) ? new.len - start : region_size;
+		uint32_t dict_end = (start + region_size < old.len) ? start + region_size : old.len;
+		uint32_t dict_start = (dict_end > dict_size) ? dict_end - dict_size : 0;
+		deflate_add(&out, new.data + start, len, window_bits, 0, old.data + dict_start, dict_end - dict_start);
+		start += len;
+	} while (start < new.len);
+	buffer_add_le32(&out, rom_crc32(&new));
+	buffer_add_le32(&out, new.len);
+	write_file(outfile, &out);
+
+	printf("Created dictionary compressed rom '%s', %d bytes (new rom %d bytes).\n", outfile, out.len, new.len);
+	return EXIT_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////
+/// Integrity trailer, so sBoot can check a file before using it.
+///
+
+static int do_seal(const char *file) {
+	buffer buf = {0};
+	uint8_t footer[8];
+	uint32_t crc, len;
+
+	read_file(file, &buf);
+	if (buf.len < sizeof(footer)) {
+		printf("File '%s' is too short.\n", file);
+		return EXIT_FAILURE;
+	}
+	crc = rom_crc32(&buf);
+	len = buf.len;
+	// keep the new rom crc32 and length at the end
+	memcpy(footer, buf.data + buf.len - sizeof(footer), sizeof(footer));
+	buffer_add_le32(&buf, CHECK_MAGIC);
+	buffer_add_le32(&buf, crc);
+	buffer_add_le32(&buf, len);
+	buffer_add(&buf, footer, sizeof(footer));
+	write_file(file, &buf);
+
+	printf("Added integrity trailer to '%s'.\n", file);
+	return EXIT_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////
+/// Manifests, listing several files to install in one go.
+///
+
+// each entry is target:name:data, the target is "rom" or an offset in
+// flash, name is the file in spiffs, and data the file that should end
+// up in flash (i.e. before compression), for its length and crc32
+static int do_manifest(const char *outfile, int count, char **entries) {
+	buffer out = {0};
+	int loop;
+
+	buffer_add_le32(&out, MANIFEST_MAGIC);
+	buffer_add_le32(&out, count);
+	for (loop = 0; loop < count; loop++) {
+		buffer data = {0};
+		uint8_t name[MANIFEST_NAME_LEN] = {0};
+		char *target = entries[loop];
+		char *file = strchr(target, ':');
+		char *datafile = file ? strchr(file + 1, ':') : NULL;
+		uint32_t offset;
+		if (!datafile || datafile - file - 1 >= MANIFEST_NAME_LEN) {
+			printf("Bad manifest entry '%s'.\n", entries[loop]);
+			exit(EXIT_FAILURE);
+		}
+		*file++ = 0;
+		*datafile++ = 0;
+		if (strcmp(target, "rom")) {
+			// the whole target must be a number, a typo mustn't become 0
+			char *end;
+			unsigned long value = strtoul(target, &end, 0);
+			if (*target < '0' || *target > '9' || *end || value == 0 || value > 0xffffffffUL || value % SECTOR_SIZE) {
+				printf("Bad target '%s', must be rom or a sector aligned offset in flash.\n", target);
+				exit(EXIT_FAILURE);
+			}
+			offset = value;
+		} else {
+			offset = MANIFEST_ROM;
+		}
+		memcpy(name, file, datafile - file - 1);
+		read_file(datafile, &data);
+		buffer_add_le32(&out, offset);
+		buffer_add_le32(&out, data.len);
+		buffer_add_le32(&out, rom_crc32(&data));
+		buffer_add(&out, name, sizeof(name));
+		free(data.data);
+	}
+	write_file(outfile, &out);
+
+	printf("Created manifest '%s', %d entries.\n", outfile, count);
+	return EXIT_SUCCESS;
+}
+
+static void usage(const char *name) {
+	printf("Usage: %s patch <OldRom.bin> <NewRom.bin> <OutFile> [WindowBits]\n", name);
+	printf("       %s dict <OldRom.bin> <NewRom.bin> <OutFile> [WindowBits] [RegionSize]\n", name);
+	printf("       %s seal <OtaFile>\n", name);
+	printf("       %s manifest <OutFile> <Target>:<SpiffsName>:<Data.bin> ...\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+
+	int window_bits = DEFAULT_WINDOW_BITS;
+
+	if (argc < 2) usage(argv[0]);
+
+	if (!strcmp(argv[1], "patch") && (argc == 5 || argc == 6)) {
+		if (argc == 6) window_bits = atoi(argv[5]);
+		if (window_bits < 9 || window_bits > 15) usage(argv[0]);
+		return do_patch(argv[2], argv[3], argv[4], window_bits);
+	}
+
+	if (!strcmp(argv[1], "dict") && argc >= 5 && argc <= 7) {
+		uint32_t region_size = DEFAULT_REGION_SIZE;
+		if (argc >= 6) window_bits = atoi(argv[5]);
+		if (argc == 7) region_size = strtoul(argv[6], NULL, 0);
+		if (window_bits < 9 || window_bits > 15 || region_size == 0) usage(argv[0]);
+		return do_dict(argv[2], argv[3], argv[4], window_bits, region_size);
+	}
+
+	if (!strcmp(argv[1], "seal") && argc == 3) {
+		return do_seal(argv[2]);
+	}
+
+	if (!strcmp(argv[1], "manifest") && argc >= 4 && argc - 3 <= MANIFEST_MAX_ENTRIES) {
+		return do_manifest(argv[2], argc - 3, argv + 3);
+	}
+
+	usage(argv[0]);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,73 @@
+#ifndef __SBOOT_OTA_H__
+#define __SBOOT_OTA_H__
+
+//////////////////////////////////////////////////
+// sBoot open source boot loader for ESP8266.
+// Copyright 2015-2019 Richard A Burton
+// richardaburton@gmail.com
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// ota file formats, other than plain gzip and lz4, shared by sBoot and
+// the host side tool (otatool), all values are little endian, and all
+// files end with the crc32 and length of the new rom, as a gzip footer
+// (except the manifest)
+
+// delta patch, applied against the installed rom
+//   header  - magic, length and crc32 of the rom it applies to
+//   body    - gzip stream of patch ops (below)
+//   trailer - crc32 and length of the new rom
+#define PATCH_MAGIC       0x50444273 // "sBDP"
+#define PATCH_HEADER_SIZE 12
+
+// patch ops, an op byte followed by its arguments (32 bit)
+// end of the patch, no arguments
+#define PATCH_OP_END    0
+// offset, length - copy length bytes from the installed rom
+#define PATCH_OP_COPY   1
+// offset, length, data - length bytes of the installed rom, each
+// added to the next byte of data
+#define PATCH_OP_ADD    2
+// length, data - length bytes of new data
+#define PATCH_OP_INSERT 3
+
+// dictionary compressed rom, each region of the new rom is a zlib stream
+// compressed with the matching part of the installed rom as a preset
+// dictionary, so data that hasn't changed compresses to very little
+//   header  - magic, length and crc32 of the rom it applies to, region
+//             size and dictionary size
+//   body    - a zlib stream for each region of the new rom, in order, the
+//             dictionary is the dictionary size bytes of the installed rom
+//             up to the end of the region (or the end of the rom if that
+//             is sooner), or fewer at the start of the rom
+//   trailer - crc32 and length of the new rom
+#define DICT_MAGIC       0x5a444273 // "sBDZ"
+#define DICT_HEADER_SIZE 20
+
+// optional integrity trailer, can be added to a file in any of the
+// formats above, checked before anything is erased, without decoding
+//   magic
+//   crc32 and length of the file before the trailer
+//   a copy of the crc32 and length of the new rom, so the file still
+//   ends with them
+#define CHECK_MAGIC        0x43464273 // "sBFC"
+#define CHECK_TRAILER_SIZE 20
+
+// manifest, to install several files in one boot, a rom and data for
+// fixed offsets in flash (e.g. rf calibration, or a spiffs image), each
+// file in any of the formats above, saved in spiffs alongside it
+//   header  - magic, number of entries
+//   entries - target offset in flash (sector aligned), or MANIFEST_ROM
+//             for the rom slot that isn't booted, length and crc32 of
+//             the data to install there, and the name of the file in
+//             spiffs holding it (nul terminated, zero padded)
+// entries whose target already holds the data are skipped
+#define MANIFEST_MAGIC       0x464d4273 // "sBMF"
+#define MANIFEST_HEADER_SIZE 8
+#define MANIFEST_NAME_LEN    32
+#define MANIFEST_ENTRY_SIZE  (12 + MANIFEST_NAME_LEN)
+#define MANIFEST_ROM         0xffffffff
+// most entries sBoot accepts
+#define MANIFEST_MAX_ENTRIES 8
+
+#endif
@@ -9,9 +9,13 @@
 //////////////////////////////////////////////////
 
 #include <sboot.h>
+#include <sboot-ota.h>
 #include <spiffs.h>
+#include <uzlib.h>
+#include <lz4.h>
 
 #define NOINLINE __attribute__ ((noinline))
+#define ALIGNED4 __attribute__ ((aligned (4)))
 
 #define ROM_MAGIC	   0xe9
 #define ROM_MAGIC_NEW1 0xea
@@ -25,20 +29,97 @@
 // flash sector size
 #define SECTOR_SIZE 0x1000
 
+// flash program page size
+#define PAGE_SIZE 0x100
+
+// bytes sent per program command, all the controller's data registers
+// (SPI_W0 to SPI_W15) hold, so a page goes out as 4 commands
+#define PROGRAM_CHUNK 64
+
+// flash block erase sizes
+#define BLOCK32_SIZE 0x8000
+#define BLOCK64_SIZE 0x10000
+
+// flash is mapped for execute in place a bank at a time
+#define FLASH_BANK_SIZE 0x100000
+
 // buffer size, must be at least 0x10 (size of rom_header_new structure)
 #define BUFFER_SIZE 0x100
 
+// ota file read buffer size, can be increased to use ram
+// saved by building with a smaller decompression window
+#ifndef SOURCE_BUFFER_SIZE
+#define SOURCE_BUFFER_SIZE SECTOR_SIZE
+#endif
+
+// data pages of the ota file mapped up front, so it can be read in runs
+// of pages (2 bytes each, covering 251 bytes of the file with 256 byte
+// pages), any of the file past that is still read, just more slowly
+#ifndef OTA_MAP_PAGES
+#define OTA_MAP_PAGES 1536
+#endif
+
 // stage2 read chunk maximum size (limit for SPIRead)
 #define READ_SIZE SECTOR_SIZE
 
+// output produced by each decompression step
+#define INFLATE_STEP 0x8000
+
+// minimum output between install checkpoints, each costs an erase
+// and program of the journal sector
+#define JOURNAL_INTERVAL 0x10000
+
 // esp8266 built in rom functions
 extern uint32_t SPIRead(uint32_t addr, void *outptr, uint32_t len);
 extern uint32_t SPIEraseSector(int);
+extern uint32_t SPI_write_enable(void *chip);
+extern uint32_t Wait_SPI_Idle(void *chip);
 extern uint32_t SPIWrite(uint32_t addr, void *inptr, uint32_t len);
+extern void Cache_Read_Enable(uint32_t odd_even, uint32_t mb_count, uint32_t no_idea);
 extern void ets_printf(const char*, ...);
 extern void ets_delay_us(int);
 extern void ets_memset(void*, uint8_t, uint32_t);
 extern void ets_memcpy(void*, const void*, uint32_t);
+extern int ets_memcmp(const void*, const void*, uint32_t);
+
+// flash chip description used by the rom functions
+extern void *flashchip;
+
+// spi flash controller registers, for commands the rom doesn't provide
+#ifndef BOOT_HOST_TEST
+#define SPI_REG(off) (*(volatile uint32_t*)(0x60000200 + (off)))
+#define SPI_CMD   SPI_REG(0x00)
+#else
+// host test build (see test/), the registers are the flash stand-in's,
+// it carries out the command written to SPI_CMD when SPI_CMD is next
+// read or written, so it is done by the time the code polls for it
+extern uint32_t host_spi_regs[];
+extern volatile uint32_t *host_spi_cmd(void);
+#define SPI_REG(off) (host_spi_regs[(off) / 4])
+#define SPI_CMD   (*host_spi_cmd())
+#endif
+#define SPI_ADDR  SPI_REG(0x04)
+#define SPI_USER  SPI_REG(0x1c)
+#define SPI_USER1 SPI_REG(0x20)
+#define SPI_USER2 SPI_REG(0x24)
+#define SPI_W0    SPI_REG(0x40)
+// data registers, 16 words from SPI_W0
+#define SPI_W(n)  SPI_REG(0x40 + (n) * 4)
+// SPI_CMD bits, each starts an operation and clears when done
+#define SPI_CMD_RDID (1 << 28)
+#define SPI_CMD_PP   (1 << 25)
+#define SPI_CMD_SE   (1 << 24)
+#define SPI_CMD_BE   (1 << 23)
+#define SPI_CMD_USR  (1 << 18)
+// SPI_USER bits, phases of a user defined command
+#define SPI_USER_COMMAND (1 << 31)
+#define SPI_USER_ADDR    (1 << 30)
+// bit lengths (minus one) of the address and command phases
+#define SPI_USER1_ADDR_BITLEN_S    26
+#define SPI_USER2_COMMAND_BITLEN_S 28
+
+// flash commands
+#define FLASH_CMD_ERASE32 0x52
 
 // functions we'll call by address
 typedef void stage2a(uint32_t);
@@ -79,23 +160,151 @@ typedef struct {
 
 // flash write status structure
 typedef struct {
+	int32_t base_addr;
+	// address of the sector being collected, and bytes in it so far
 	int32_t start_addr;
-	int32_t last_sector_erased;
-	int32_t extra_count;
-	uint8_t extra_bytes[4];
+	uint32_t count;
+	uint8_t sector[SECTOR_SIZE] ALIGNED4;
+	// next address to erase, and end of the area to erase ahead of
+	// the writes, nothing is erased ahead when writing in place
+	uint32_t erase_next;
+	uint32_t erase_end;
+	// end of the area that may be written
+	uint32_t end_addr;
+	// set if there was more output than expected, none of it past the
+	// end is written
+	uint32_t overrun;
+	// writing over data in place, rather than to an empty slot, so
+	// each sector is compared with the flash first, and only erased
+	// and programmed if it differs
+	uint32_t in_place;
+	// true if the sector being collected has already been erased, in
+	// place, to program part of it for a checkpoint
+	uint32_t erased;
+	// sectors written, and those skipped as unchanged, in place
+	uint32_t sectors;
+	uint32_t skipped;
 } flash_write_status;
 
 // decompression data structure
 typedef struct {
 	flash_write_status flasher;
 	spiffs_file fd;
-	uint8_t source[SECTOR_SIZE];
-	uint32_t dry_run;
+	uint8_t source[SOURCE_BUFFER_SIZE] ALIGNED4;
+#ifdef BOOT_SPIFFS_LITE
+	// where the data pages of the ota file are
+	spiffs_page_ix map[OTA_MAP_PAGES];
+#endif
+	// installed rom, patches are applied against it
+	uint32_t rom_addr;
 } decomp_data;
 
+// patch is for a different rom than the one installed
+#define PATCH_BASE_ERROR (-16)
+// file doesn't match its manifest entry, or can't go to its target
+#define MANIFEST_ERROR (-17)
+// file doesn't match its integrity trailer
+#define CHECK_ERROR (-18)
+// rom is too big for its slot, or the slot is past the end of the
+// flash, or its size isn't known
+#define SLOT_ERROR (-19)
+
+// a file to install, from the manifest, or the ota file on its own
+typedef struct {
+	// offset in flash, or MANIFEST_ROM for the slot that isn't booted
+	uint32_t target;
+	// length and crc32 of the data to install
+	uint32_t len;
+	uint32_t crc;
+	char name[MANIFEST_NAME_LEN];
+} update_entry;
+
+// delta patch status, the body is decompressed by uzlib and the
+// patch ops are run on its output as it arrives, also used for
+// dictionary compressed roms
+typedef struct {
+	// from the header & trailer
+	uint32_t old_len;
+	uint32_t new_len;
+	uint32_t new_crc;
+	// current op, and arguments collected so far
+	uint8_t op;
+	uint8_t arg_count;
+	uint8_t args[8];
+	uint32_t offset;
+	uint32_t left;
+	// dictionary compressed rom regions, and start of the current one
+	uint32_t region_size;
+	uint32_t dict_size;
+	uint32_t region_start;
+	// output so far
+	uint32_t out_len;
+	uint32_t out_crc;
+	int32_t error;
+	uint32_t done;
+	// reads from the installed rom, aligned for SPIRead plus space
+	// to align the start and end
+	uint8_t buffer[BUFFER_SIZE + 8] ALIGNED4;
+	decomp_data *decomp;
+} patch_status;
+
+// install journal, a checkpoint of an install in progress, at a point
+// where all the output so far has been written, so an interrupted
+// install can carry on from there
+#define BOOT_JOURNAL_MAGIC 0x4a624273 // "sBbJ"
+typedef struct {
+	uint32_t magic;
+	// what is being installed where, codec is the index in the codec
+	// table, and the expected length and crc32 of the new data
+	uint32_t addr;
+	uint32_t codec;
+	uint32_t new_len;
+	uint32_t new_crc;
+	// offset in the ota file of the next input
+	uint32_t in_pos;
+	// output written so far, and its crc32 (not finalised)
+	uint32_t out_len;
+	uint32_t out_crc;
+	// codec state
+	union {
+		UZLIB_SYNC gzip;
+		LZ4_SYNC lz4;
+	} state;
+	// crc32 of the fields above
+	uint32_t crc;
+} install_journal;
+
+// decompressor backend, chosen by the magic bytes at the start of the file
+typedef struct {
+	// returns true if the file starts with this codec's magic (4 bytes)
+	uint32_t (*probe)(const uint8_t *magic);
+	// reads the expected length and crc32 of the image from the file
+	uint32_t (*expected)(spiffs_file fd, uint32_t *len, uint32_t *crc);
+	// stream decode into put_bytes, as the uzlib step-wise api
+	int32_t (*init)(decomp_data *decomp);
+	int32_t (*step)(uint32_t budget);
+	int32_t (*finish)(void);
+	// true if the file is applied against the installed rom, so can
+	// only be installed as a rom
+	uint32_t uses_rom;
+	// optional, if between steps the codec is at a point it can resume
+	// from, passes on all its output and fills in the journal input,
+	// output and state, returns true if so
+	uint32_t (*sync)(decomp_data *decomp, install_journal *journal);
+	// instead of init, carry on from a journal checkpoint
+	int32_t (*resume)(decomp_data *decomp, install_journal *journal);
+} decomp_codec;
+
+// copies of the boot config
+#define BOOT_CONFIG_COPIES 2
+
 // simple partition info
 typedef struct {
-	uint32_t boot_offset;
+	uint32_t config_offset[BOOT_CONFIG_COPIES];
+	uint32_t journal_offset;
+	uint32_t slot_offset[BOOT_SLOTS];
+	uint32_t slot_size;
+	uint32_t loader_size;
 	uint32_t spiffs_offset;
 	uint32_t spiffs_size;
 } partition_info;
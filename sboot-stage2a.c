@@ -12,6 +12,7 @@ usercode* NOINLINE load_rom(uint32_t readpos) {
 	uint8_t sectcount;
 	uint8_t *writepos;
 	uint32_t remaining;
+	uint32_t bank = readpos / FLASH_BANK_SIZE;
 	usercode* usercode;
 	
 	rom_header header;
@@ -48,6 +49,11 @@ usercode* NOINLINE load_rom(uint32_t readpos) {
 		}
 	}
 
+	// map the 1MB bank holding the rom for execute in place, so it runs
+	// from any slot, selected as the odd or even 1MB of the lower or
+	// upper 2MB of the flash
+	Cache_Read_Enable(bank & 1, (bank >> 1) & 1, 1);
+
 	return usercode;
 }
 
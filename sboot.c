@@ -6,9 +6,128 @@
 //////////////////////////////////////////////////
 
 #include <sboot-private.h>
+#ifndef BOOT_HOST_TEST
 #include <sboot-hex2a.h>
+#endif
 #include <spiffs.h>
+#include <spiffs_lite.h>
 #include <uzlib.h>
+#include <lz4.h>
+
+////////////////////////////////////////////////////////////////
+/// This code talks to the spi flash controller directly, so
+/// erases and programs run in the background, the rom functions
+/// wait for each to finish. Any flash access first waits for the
+/// last operation to finish, by polling the flash status.
+///
+
+// true if an erase or program may still be in progress
+static uint32_t flash_busy;
+
+// which block erase commands the flash supports
+static uint32_t flash_erase64;
+static uint32_t flash_erase32;
+
+// size of the flash, from its jedec id, 0 if not known
+static uint32_t flash_size;
+
+// manufacturer ids of flash chips that support the 32k block erase
+static const uint8_t erase32_makers[] = {
+	0xef, // winbond
+	0xc8, // gigadevice
+	0xc2, // macronix
+	0x9d, // issi
+	0x68, // boya
+	0x85, // puya
+	0x5e, // zbit
+};
+
+// wait for the last erase or program to finish
+static void flash_wait(void) {
+	if (flash_busy) {
+		Wait_SPI_Idle(flashchip);
+		flash_busy = FALSE;
+	}
+}
+
+static uint32_t flash_read(uint32_t addr, void *data, uint32_t len) {
+	flash_wait();
+	return SPIRead(addr, data, len);
+}
+
+// read the flash jedec id, manufacturer in the low byte, followed
+// by the memory type and capacity
+static uint32_t flash_read_id(void) {
+	flash_wait();
+	SPI_W0 = 0;
+	SPI_CMD = SPI_CMD_RDID;
+	while (SPI_CMD);
+	return SPI_W0 & 0xffffff;
+}
+
+// start erasing a sector, or block (of BLOCK32_SIZE or BLOCK64_SIZE),
+// the 32k block erase has no controller command so is sent as a user
+// defined command, leaving the controller as we found it
+static void flash_erase_start(uint32_t addr, uint32_t size) {
+	flash_wait();
+	SPI_write_enable(flashchip);
+	if (size == BLOCK32_SIZE) {
+		uint32_t user = SPI_USER;
+		uint32_t user1 = SPI_USER1;
+		uint32_t user2 = SPI_USER2;
+		SPI_USER = SPI_USER_COMMAND | SPI_USER_ADDR;
+		SPI_USER1 = 23 << SPI_USER1_ADDR_BITLEN_S;
+		SPI_USER2 = (7 << SPI_USER2_COMMAND_BITLEN_S) | FLASH_CMD_ERASE32;
+		SPI_ADDR = addr << 8;
+		SPI_CMD = SPI_CMD_USR;
+		while (SPI_CMD);
+		SPI_USER = user;
+		SPI_USER1 = user1;
+		SPI_USER2 = user2;
+	} else {
+		SPI_ADDR = addr & 0xffffff;
+		SPI_CMD = (size == BLOCK64_SIZE) ? SPI_CMD_BE : SPI_CMD_SE;
+		while (SPI_CMD);
+	}
+	flash_busy = TRUE;
+}
+
+// start programming up to a page, data must be word aligned, sent
+// PROGRAM_CHUNK bytes per command, each waits for the one before, so
+// only the last runs in the background
+static void flash_program_start(uint32_t addr, const uint8_t *data, uint32_t len) {
+	const uint32_t *word = (const uint32_t*)data;
+	while (len > 0) {
+		uint32_t chunk = MIN(len, PROGRAM_CHUNK);
+		uint32_t loop;
+		flash_wait();
+		SPI_write_enable(flashchip);
+		for (loop = 0; loop < chunk / 4; loop++) SPI_W(loop) = *word++;
+		SPI_ADDR = (addr & 0xffffff) | (chunk << 24);
+		SPI_CMD = SPI_CMD_PP;
+		while (SPI_CMD);
+		flash_busy = TRUE;
+		addr += chunk;
+		len -= chunk;
+	}
+}
+
+// decide which erase commands to use, and find the flash size, from
+// the flash jedec id, if it can't be read only sector erases are used,
+// and the size isn't known
+static void flash_init(void) {
+	uint32_t id = flash_read_id();
+	uint8_t maker = id & 0xff;
+	uint8_t capacity = (id >> 16) & 0xff;
+	uint32_t loop;
+	// capacity is the size as a power of 2, 512k to 16MB
+	flash_size = (capacity >= 19 && capacity <= 24) ? (1 << capacity) : 0;
+	flash_erase64 = (maker != 0x00 && maker != 0xff);
+	flash_erase32 = FALSE;
+	for (loop = 0; loop < sizeof(erase32_makers); loop++) {
+		if (maker == erase32_makers[loop]) flash_erase32 = TRUE;
+	}
+}
 
 ////////////////////////////////////////////////////////////////
 /// This code deals with spiffs integration, including aligned
@@ -17,19 +136,83 @@
 
 #define LOG_PAGE_SIZE 256
 
+#ifdef BOOT_SPIFFS_LITE
+static spiffs_lite fs;
+
+// file access, through the read only reader
+#define FILE_OPEN(name)             spiffs_lite_open(&fs, name)
+#define FILE_READ(fd, buf, len)     spiffs_lite_read(&fs, fd, buf, len)
+#define FILE_LSEEK(fd, offs, whence) spiffs_lite_lseek(&fs, fd, offs, whence)
+#define FILE_TELL(fd)               spiffs_lite_tell(&fs, fd)
+#define FILE_CLOSE(fd)              spiffs_lite_close(&fs, fd)
+#define FILE_ERRNO()                spiffs_lite_errno(&fs)
+#else
 static u8_t spiffs_fds[32*4];
 static u8_t spiffs_work_buf[LOG_PAGE_SIZE*2];
 static u8_t spiffs_cache_buf[(LOG_PAGE_SIZE+32)*4];
 
 static spiffs fs;
 
+// file access, through the spiffs library
+#define FILE_OPEN(name)             SPIFFS_open(&fs, name, SPIFFS_RDONLY, 0)
+#define FILE_READ(fd, buf, len)     SPIFFS_read(&fs, fd, buf, len)
+#define FILE_LSEEK(fd, offs, whence) SPIFFS_lseek(&fs, fd, offs, whence)
+#define FILE_TELL(fd)               SPIFFS_tell(&fs, fd)
+#define FILE_CLOSE(fd)              SPIFFS_close(&fs, fd)
+#define FILE_ERRNO()                SPIFFS_errno(&fs)
+#endif
+
+#ifdef BOOT_SPI_CACHE_SECTORS
+// read cache, whole sectors, replaced in turn
+static uint8_t spi_cache[BOOT_SPI_CACHE_SECTORS][SECTOR_SIZE] ALIGNED4;
+static uint32_t spi_cache_addr[BOOT_SPI_CACHE_SECTORS];
+static uint32_t spi_cache_next;
+static uint32_t spi_cache_hits;
+static uint32_t spi_cache_misses;
+
+// the cached copy of a sector, or null if it isn't cached and fill isn't
+// set, otherwise it is read in, in place of the one cached longest
+static uint8_t *spi_cache_sector(uint32_t addr, uint32_t fill) {
+	uint32_t loop;
+	for (loop = 0; loop < BOOT_SPI_CACHE_SECTORS; loop++) {
+		if (spi_cache_addr[loop] == addr) {
+			spi_cache_hits++;
+			return spi_cache[loop];
+		}
+	}
+	spi_cache_misses++;
+	if (!fill) return NULL;
+	loop = spi_cache_next;
+	spi_cache_next = (spi_cache_next + 1) % BOOT_SPI_CACHE_SECTORS;
+	flash_read(addr, spi_cache[loop], SECTOR_SIZE);
+	spi_cache_addr[loop] = addr;
+	return spi_cache[loop];
+}
+#endif
+
 static int32_t my_spi_read(uint32_t addr, uint32_t size, uint8_t *dst) {
 
+#ifdef BOOT_SPI_CACHE_SECTORS
+	// reads within a sector come from the cache, so nearby reads (e.g. of
+	// lookup pages and page headers) don't go to the flash again, reads of
+	// a page or more are only served from it if their sector is already
+	// there, otherwise they go straight to the flash, so scattered data
+	// pages aren't each read a whole sector at a time
+	if (size < SECTOR_SIZE && (addr & (SECTOR_SIZE - 1)) + size <= SECTOR_SIZE) {
+		uint32_t sector = addr & ~(SECTOR_SIZE - 1);
+		uint8_t *cached = spi_cache_sector(sector, size < LOG_PAGE_SIZE);
+		if (cached) {
+			ets_memcpy(dst, cached + (addr - sector), size);
+			return SPIFFS_OK;
+		}
+	}
+#endif
+
 	uint32_t aligned = addr & ~3;
 	if (addr > aligned) {
 		uint32_t c = MIN(4-(addr-aligned), size);
 		uint8_t buff[4];
-		SPIRead(aligned, buff, sizeof(buff));
+		flash_read(aligned, buff, sizeof(buff));
 		ets_memcpy(dst, buff+sizeof(buff)-c, c);
 		addr += c;
 		size -= c;
@@ -38,7 +221,7 @@ static int32_t my_spi_read(uint32_t addr, uint32_t size, uint8_t *dst) {
 
 	if (size > 4) {
 		uint32_t c = size & ~3;
-		SPIRead(addr, dst, c);
+		flash_read(addr, dst, c);
 		addr += c;
 		size -= c;
 		dst += c;
@@ -46,7 +229,7 @@ static int32_t my_spi_read(uint32_t addr, uint32_t size, uint8_t *dst) {
 
 	if (size > 0) {
 		uint8_t buff[4];
-		SPIRead(addr, buff, sizeof(buff));
+		flash_read(addr, buff, sizeof(buff));
 		ets_memcpy(dst, buff, size);
 	}
 
@@ -65,6 +248,15 @@ static int32_t my_spiffs_mount(partition_info *parts) {
 	cfg.hal_write_f = 0;
 	cfg.hal_erase_f = 0;
 
+#ifdef BOOT_SPI_CACHE_SECTORS
+	ets_memset(spi_cache_addr, 0xff, sizeof(spi_cache_addr));
+	spi_cache_hits = spi_cache_misses = 0;
+#endif
+
+#ifdef BOOT_SPIFFS_LITE
+	// just checks the config and magic, nothing is scanned
+	return spiffs_lite_mount(&fs, &cfg);
+#else
 	return SPIFFS_mount(&fs,
 	  &cfg,
 	  spiffs_work_buf,
@@ -73,95 +265,247 @@ static int32_t my_spiffs_mount(partition_info *parts) {
 	  spiffs_cache_buf,
 	  sizeof(spiffs_cache_buf),
 	  0);
+#endif
+}
+
+static void my_spiffs_unmount(void) {
+#ifndef BOOT_SPIFFS_LITE
+	SPIFFS_unmount(&fs);
+#endif
+#ifdef BOOT_SPI_CACHE_SECTORS
+	ets_printf("spiffs read cache: %d hits, %d misses.\n", spi_cache_hits, spi_cache_misses);
+#endif
 }
 
 static void list_directory(void) {
+#ifdef BOOT_SPIFFS_LITE
+	spiffs_lite_dir d;
+#else
 	spiffs_DIR d;
+#endif
 	struct spiffs_dirent e;
 	struct spiffs_dirent *pe = &e;
+	ets_printf("\nContents of spiffs filesystem:\n");
+#ifdef BOOT_SPIFFS_LITE
+	spiffs_lite_opendir(&fs, &d);
+	while ((pe = spiffs_lite_readdir(&d, pe))) {
+#else
 	SPIFFS_opendir(&fs, "/", &d);
-	ets_printf("\nContents of spiffs filesystem:\n", pe->name, pe->obj_id, pe->size);
 	while ((pe = SPIFFS_readdir(&d, pe))) {
+#endif
 		ets_printf("    [id:%04x] size:0x%08x %s\n", pe->obj_id, pe->size, pe->name);
 	}
 	ets_printf("End of spiffs.\n\n");
+#ifndef BOOT_SPIFFS_LITE
 	SPIFFS_closedir(&d);
+#endif
 }
 
 ////////////////////////////////////////////////////////////////
-/// This code deals with aligned (4 byte) writes to the spi
-/// flash.
+/// This code deals with writes to the spi flash, a sector at a
+/// time. The area the new rom will occupy is erased just ahead
+/// of the writes, using block erases where possible. Data written
+/// in place skips sectors that haven't changed.
 ///
 
-// setup the write status struct, based on supplied start address
-static void flash_write_init(flash_write_status *status, int32_t start_addr) {
+// start erasing the next part of the area to erase ahead, with the
+// biggest erase that fits, it runs while the data for it is
+// decompressed
+static void flash_write_erase_ahead(flash_write_status *status) {
+	uint32_t addr = status->erase_next;
+	uint32_t size;
+	if (addr >= status->erase_end) return;
+	if (flash_erase64 && (addr % BLOCK64_SIZE) == 0 && status->erase_end - addr >= BLOCK64_SIZE) {
+		size = BLOCK64_SIZE;
+	} else if (flash_erase32 && (addr % BLOCK32_SIZE) == 0 && status->erase_end - addr >= BLOCK32_SIZE) {
+		size = BLOCK32_SIZE;
+	} else {
+		size = SECTOR_SIZE;
+	}
+	flash_erase_start(addr, size);
+	status->erase_next += size;
+}
+
+// setup the write status struct, based on supplied start address,
+// which must be sector aligned, and expected length, to erase ahead,
+// unless writing in place, nothing is erased until the first write, so
+// a file rejected as its header is read leaves the flash untouched
+static void flash_write_init(flash_write_status *status, int32_t start_addr, uint32_t len, uint32_t in_place) {
+	status->base_addr = start_addr;
 	status->start_addr = start_addr;
-	status->extra_count = 0;
-	status->last_sector_erased = (start_addr / SECTOR_SIZE) - 1;
+	status->count = 0;
+	status->end_addr = start_addr + ((len + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1));
+	status->erase_next = start_addr;
+	status->erase_end = in_place ? start_addr : status->end_addr;
+	status->overrun = FALSE;
+	status->in_place = in_place;
+	status->erased = FALSE;
+	status->sectors = 0;
+	status->skipped = 0;
 }
 
-// function to do the actual writing to flash,
-// call repeatedly with more data
-static uint32_t flash_write(flash_write_status *status, uint8_t *data, uint32_t len) {
-	
-	uint8_t *buffer;
-	uint32_t lastsect;
+// setup the write status struct to carry on from pos, after a reset,
+// what was written of the sector pos is in is read back, the area from
+// there is erased again, as erases running at the reset may not have
+// finished, but the sector itself only if nothing in it needs keeping,
+// in place the sectors are compared as before, so nothing is erased
+static void flash_write_resume(flash_write_status *status, int32_t start_addr, uint32_t len, uint32_t pos, uint32_t in_place) {
+	uint32_t loop;
+	status->base_addr = start_addr;
+	status->start_addr = start_addr + (pos & ~(SECTOR_SIZE - 1));
+	status->count = pos & (SECTOR_SIZE - 1);
+	status->end_addr = start_addr + ((len + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1));
+	status->erase_next = status->start_addr;
+	status->erase_end = in_place ? status->start_addr : status->end_addr;
+	status->overrun = FALSE;
+	status->in_place = in_place;
+	status->erased = FALSE;
+	status->sectors = 0;
+	status->skipped = 0;
+	if (status->count > 0) {
+		// its erase finished before the part was programmed, so it can
+		// be kept unless some of the rest was programmed after that
+		flash_read(status->start_addr, status->sector, SECTOR_SIZE);
+		status->erased = TRUE;
+		for (loop = status->count; loop < SECTOR_SIZE; loop++) {
+			if (status->sector[loop] != 0xff) {
+				status->erased = FALSE;
+				break;
+			}
+		}
+		if (status->erased && !in_place) status->erase_next += SECTOR_SIZE;
+	}
+	flash_write_erase_ahead(status);
+}
 
-	if (data == NULL || len == 0) {
-		return TRUE;
+// program the sector buffer into an erased sector, a page at a time,
+// as each program command can write at most a page, pages that are
+// all 0xff are left as erased
+static void flash_write_program(flash_write_status *status) {
+	uint32_t page, loop;
+	for (page = 0; page < SECTOR_SIZE; page += PAGE_SIZE) {
+		uint32_t *word = (uint32_t*)(status->sector + page);
+		for (loop = 0; loop < PAGE_SIZE / 4; loop++) {
+			if (word[loop] != 0xffffffff) {
+				flash_program_start(status->start_addr + page, status->sector + page, PAGE_SIZE);
+				break;
+			}
+		}
 	}
+}
 
-	// erase any additional sectors needed by this chunk
-	lastsect = ((status->start_addr + status->extra_count + len) - 1) / SECTOR_SIZE;
-	while (lastsect > status->last_sector_erased) {
-		status->last_sector_erased++;
-		SPIEraseSector(status->last_sector_erased);
+// compare the sector buffer with the flash, returns true if the same
+static uint32_t flash_write_same(flash_write_status *status) {
+	uint8_t buffer[BUFFER_SIZE] ALIGNED4;
+	uint32_t pos;
+	for (pos = 0; pos < SECTOR_SIZE; pos += sizeof(buffer)) {
+		flash_read(status->start_addr + pos, buffer, sizeof(buffer));
+		if (ets_memcmp(buffer, status->sector + pos, sizeof(buffer))) return FALSE;
 	}
+	return TRUE;
+}
 
-	// finish any remaining bytes from previous write
-	if (status->extra_count > 0) {
-		while ((status->extra_count < 4) && (len > 0)) {
-			status->extra_bytes[status->extra_count++] = data[0];
-			data++;
-			len--;
-		}
-		if (status->extra_count == 4) {
-			SPIWrite(status->start_addr, (uint32_t *)((void *)status->extra_bytes), 4);
-			status->start_addr += 4;
-			status->extra_count = 0;
-		}
+// write out the sector buffer, padded with 0xff, its erase has already
+// been started, unless writing in place, when it is only erased and
+// programmed if the flash doesn't already hold the same
+static void flash_write_sector(flash_write_status *status) {
+	ets_memset(status->sector + status->count, 0xff, SECTOR_SIZE - status->count);
+	status->sectors++;
+	if (status->in_place && !status->erased && flash_write_same(status)) {
+		status->skipped++;
+	} else {
+		if (status->in_place && !status->erased) flash_erase_start(status->start_addr, SECTOR_SIZE);
+		flash_write_program(status);
 	}
+	status->start_addr += SECTOR_SIZE;
+	status->count = 0;
+	status->erased = FALSE;
+	// start erasing the next sectors, if not already
+	if (status->erase_next <= status->start_addr) flash_write_erase_ahead(status);
+}
 
-	if (len > 0) {
-		// length must be multiple of 4 to write,
-		// save any remaining bytes for next go
-		uint32_t extras = len % 4;
-		if (extras > 0) {
-			status->extra_count = extras;
-			len -= extras;
-			ets_memcpy(status->extra_bytes, data+len, extras);
+// function to do the actual writing to flash,
+// call repeatedly with more data, returns false, and sets overrun, if
+// it goes past the expected length (rounded up to a whole sector), as
+// the flash after that may be in use (e.g. the other slot or spiffs)
+static uint32_t flash_write(flash_write_status *status, uint8_t *data, uint32_t len) {
+	// start erasing, on the first write
+	if (status->erase_next <= status->start_addr) flash_write_erase_ahead(status);
+	while (len > 0) {
+		uint32_t next = MIN(len, SECTOR_SIZE - status->count);
+		if (status->start_addr >= status->end_addr) {
+			status->overrun = TRUE;
+			return FALSE;
 		}
+		ets_memcpy(status->sector + status->count, data, next);
+		status->count += next;
+		data += next;
+		len -= next;
+		if (status->count == SECTOR_SIZE) flash_write_sector(status);
 	}
+	return TRUE;
+}
 
-	if (len > 0) {
-		// write main current chunk
-		SPIWrite(status->start_addr, (uint32_t *)((void*)data), len);
-		status->start_addr += len;
+// program the part sector collected so far, so everything written is
+// in flash, returns false if it can't be as the sector isn't erased
+// yet, the whole sector is still programmed when it is complete, the
+// same data again makes no difference, programming only clears bits,
+// in place the sector is erased now, rather than compared later
+static uint32_t flash_write_flush(flash_write_status *status) {
+	uint32_t page;
+	if (status->in_place) {
+		if (!status->erased && status->count > 0) {
+			flash_erase_start(status->start_addr, SECTOR_SIZE);
+			status->erased = TRUE;
+		}
+	} else if (status->start_addr >= status->erase_end) return FALSE;
+	if (status->count % PAGE_SIZE) {
+		ets_memset(status->sector + status->count, 0xff, PAGE_SIZE - status->count % PAGE_SIZE);
 	}
-
+	for (page = 0; page < status->count; page += PAGE_SIZE) {
+		flash_program_start(status->start_addr + page, status->sector + page, PAGE_SIZE);
+	}
+	flash_wait();
 	return TRUE;
 }
 
-// ensure any remaning bytes get written (needed for files not a multiple of 4 bytes)
+// ensure the last part sector gets written, and finishes
 static uint32_t flash_write_end(flash_write_status *status) {
-	if (status->extra_count > 0) {
-		// dummy data with which to make up 4 bytes (including existing extras)
-		uint32_t data = 0xffffffff;
-		return flash_write(status, (uint8_t*)&data, 4-status->extra_count);
-	}
+	if (status->count > 0) flash_write_sector(status);
+	flash_wait();
 	return TRUE;
 }
 
+// read back data already written, pos is the offset from the start
+// address, including any still in the sector buffer
+// pos and len must be multiples of 4
+static void flash_write_read(flash_write_status *status, uint32_t pos, uint8_t *data, uint32_t len) {
+	uint32_t addr = status->base_addr + pos;
+	flash_read(addr, data, len);
+	if (status->count > 0 && status->start_addr < addr + len && status->start_addr + status->count > addr) {
+		uint32_t from = MAX(addr, status->start_addr);
+		uint32_t to = MIN(addr + len, status->start_addr + status->count);
+		ets_memcpy(data + (from - addr), status->sector + (from - status->start_addr), to - from);
+	}
+}
+
+// crc32 of an area of flash
+static uint32_t flash_crc32(uint32_t addr, uint32_t len) {
+	// aligned for flash_read and the word at a time crc32
+	uint8_t buffer[SECTOR_SIZE] ALIGNED4;
+	uint32_t crc = 0xffffffff;
+	uint32_t read_len = (len & 3) ? (len | 3) + 1 : len;
+	while (read_len > 0) {
+		uint32_t read_next = MIN(sizeof(buffer), read_len);
+		flash_read(addr, buffer, read_next);
+		crc = uzlib_crc32(buffer, MIN(read_next, len), crc);
+		addr += read_next;
+		read_len -= read_next;
+		len -= MIN(read_next, len);
+	}
+	return crc ^ 0xffffffff;
+}
+
 ////////////////////////////////////////////////////////////////
 /// This code deals with uzlib, for decompression of the OTA
 /// image.
@@ -169,7 +513,7 @@ static uint32_t flash_write_end(flash_write_status *status) {
 
 uint32_t get_source(void *cb_data) {
 	decomp_data *decomp = (decomp_data *)cb_data;
-	int32_t len = SPIFFS_read(&fs, decomp->fd, decomp->source, sizeof(decomp->source));
+	int32_t len = FILE_READ(decomp->fd, decomp->source, sizeof(decomp->source));
 	if (len <= 0) {
 		ets_printf("spiffs read error %d\n", len);
 		return 0;
@@ -179,7 +523,379 @@ uint32_t get_source(void *cb_data) {
 
 void put_bytes(void *cb_data, uint8_t *data, uint32_t len) {
 	decomp_data *decomp = (decomp_data *)cb_data;
-	if (!decomp->dry_run) flash_write(&decomp->flasher, data, len);
+	// when testing the flasher only compares
+	flash_write(&decomp->flasher, data, len);
+}
+
+void get_history(void *cb_data, uint32_t pos, uint8_t *data, uint32_t len) {
+	decomp_data *decomp = (decomp_data *)cb_data;
+	flash_write_read(&decomp->flasher, pos, data, len);
+}
+
+// decompression state, static as it includes the window, only
+// one codec is used at a time so they can share the memory
+static union {
+	UZLIB_DATA gzip;
+	LZ4_DATA lz4;
+} state;
+
+static uint32_t get_le_uint32(const uint8_t *data) {
+	return data[0] | (data[1]<<8) | (data[2]<<16) | ((uint32_t)data[3]<<24);
+}
+
+// read the expected image crc & length from the last 8 bytes of the
+// file, the gzip footer, lz4 files end with a skippable frame holding
+// a copy of the gzip footer so they are the same
+static uint32_t read_footer(spiffs_file fd, uint32_t *len, uint32_t *crc) {
+	uint8_t buffer[8];
+	if (FILE_LSEEK(fd, -8, SPIFFS_SEEK_END) < 0) {
+		ets_printf("spiffs lseek error %d\n", FILE_ERRNO());
+		return FALSE;
+	}
+	if (FILE_READ(fd, (u8_t *)buffer, 8) != 8) {
+		ets_printf("spiffs read error %d\n", FILE_ERRNO());
+		return FALSE;
+	}
+	*crc = get_le_uint32(buffer);
+	*len = get_le_uint32(buffer + 4);
+	return TRUE;
+}
+
+static uint32_t gzip_probe(const uint8_t *magic) {
+	return (magic[0] == 0x1f && magic[1] == 0x8b);
+}
+
+static int32_t gzip_init(decomp_data *decomp) {
+	uzlib_inflate_init(&state.gzip, get_source, put_bytes, decomp, decomp->source);
+#ifdef BOOT_FLASH_WINDOW
+	uzlib_inflate_set_history(&state.gzip, get_history);
+#endif
+	return UZLIB_OK;
+}
+
+static int32_t gzip_step(uint32_t budget) {
+	return uzlib_inflate_step(&state.gzip, budget);
+}
+
+static int32_t gzip_finish(void) {
+	return uzlib_inflate_finish(&state.gzip);
+}
+
+static uint32_t gzip_sync(decomp_data *decomp, install_journal *journal) {
+	int32_t unread = uzlib_inflate_sync(&state.gzip, &journal->state.gzip);
+	if (unread < 0) return FALSE;
+	journal->in_pos = FILE_TELL(decomp->fd) - unread;
+	journal->out_len = journal->state.gzip.dest_len + journal->state.gzip.decomp_pos;
+	journal->out_crc = journal->state.gzip.checksum;
+	return TRUE;
+}
+
+static int32_t gzip_resume(decomp_data *decomp, install_journal *journal) {
+	gzip_init(decomp);
+	if (FILE_LSEEK(decomp->fd, journal->in_pos, SPIFFS_SEEK_SET) < 0) return UZLIB_DATA_ERROR;
+	uzlib_inflate_resume(&state.gzip, &journal->state.gzip, get_history);
+	return UZLIB_OK;
+}
+
+static uint32_t lz4_probe(const uint8_t *magic) {
+	uint32_t val = get_le_uint32(magic);
+	return (val == LZ4_MAGIC || (val & LZ4_SKIP_MAGIC_MASK) == LZ4_SKIP_MAGIC);
+}
+
+static int32_t lz4_init(decomp_data *decomp) {
+	// lz4 back references reach further than the window
+	lz4_decode_init(&state.lz4, get_source, put_bytes, decomp, decomp->source);
+	lz4_decode_set_history(&state.lz4, get_history);
+	return UZLIB_OK;
+}
+
+static int32_t lz4_step(uint32_t budget) {
+	return lz4_decode_step(&state.lz4, budget);
+}
+
+static int32_t lz4_finish(void) {
+	return lz4_decode_finish(&state.lz4);
+}
+
+static uint32_t lz4_sync(decomp_data *decomp, install_journal *journal) {
+	int32_t unread = lz4_decode_sync(&state.lz4, &journal->state.lz4);
+	if (unread < 0) return FALSE;
+	journal->in_pos = FILE_TELL(decomp->fd) - unread;
+	journal->out_len = journal->state.lz4.dest_len + journal->state.lz4.decomp_pos;
+	journal->out_crc = journal->state.lz4.checksum;
+	return TRUE;
+}
+
+static int32_t lz4_resume(decomp_data *decomp, install_journal *journal) {
+	lz4_init(decomp);
+	if (FILE_LSEEK(decomp->fd, journal->in_pos, SPIFFS_SEEK_SET) < 0) return UZLIB_DATA_ERROR;
+	lz4_decode_resume(&state.lz4, &journal->state.lz4, get_history);
+	return UZLIB_OK;
+}
+
+////////////////////////////////////////////////////////////////
+/// This code deals with delta patches, the patch body is gzip
+/// compressed, and the patch ops are run on the output of uzlib.
+///
+
+static patch_status patch;
+
+// pass on new rom data, keeping track of its crc & length
+static void patch_output(uint8_t *data, uint32_t len) {
+	if (patch.out_len + len > patch.new_len) {
+		patch.error = UZLIB_LENGTH_ERROR;
+		return;
+	}
+	patch.out_crc = uzlib_crc32(data, len, patch.out_crc);
+	patch.out_len += len;
+	put_bytes(patch.decomp, data, len);
+}
+
+// read from the installed rom, at most BUFFER_SIZE bytes, into the
+// patch buffer (aligned for flash_read), returns pointer to the data
+static uint8_t *patch_read_rom(uint32_t offset, uint32_t len) {
+	uint32_t addr = patch.decomp->rom_addr + offset;
+	uint32_t aligned = addr & ~3;
+	flash_read(aligned, patch.buffer, ((addr + len + 3) & ~3) - aligned);
+	return patch.buffer + (addr - aligned);
+}
+
+// run the current op on (up to) len bytes of patch data, returns
+// the number of bytes of data used
+static uint32_t patch_run_op(uint8_t *data, uint32_t len) {
+	uint32_t used = 0;
+	while (patch.left > 0 && patch.error == UZLIB_OK) {
+		uint32_t next = MIN(patch.left, BUFFER_SIZE);
+		if (patch.op == PATCH_OP_COPY) {
+			patch_output(patch_read_rom(patch.offset, next), next);
+		} else {
+			uint32_t loop;
+			uint8_t *rom;
+			next = MIN(next, len - used);
+			if (next == 0) break;
+			if (patch.op == PATCH_OP_ADD) {
+				rom = patch_read_rom(patch.offset, next);
+				for (loop = 0; loop < next; loop++) rom[loop] += data[used + loop];
+				patch_output(rom, next);
+			} else {
+				patch_output(data + used, next);
+			}
+			used += next;
+		}
+		patch.offset += next;
+		patch.left -= next;
+	}
+	if (patch.left == 0) patch.op = PATCH_OP_END;
+	return used;
+}
+
+// uzlib output callback, parses and runs the patch ops
+void patch_put_bytes(void *cb_data, uint8_t *data, uint32_t len) {
+	while (len > 0 && patch.error == UZLIB_OK) {
+		uint32_t used;
+		if (patch.done) {
+			// nothing allowed after the end
+			patch.error = UZLIB_DATA_ERROR;
+		} else if (patch.op == PATCH_OP_END) {
+			// start of a new op
+			patch.op = *data++;
+			len--;
+			patch.arg_count = 0;
+			if (patch.op == PATCH_OP_END) patch.done = TRUE;
+			else if (patch.op > PATCH_OP_INSERT) patch.error = UZLIB_DATA_ERROR;
+		} else if (patch.arg_count < (patch.op == PATCH_OP_INSERT ? 4 : 8)) {
+			// collect the arguments
+			patch.args[patch.arg_count++] = *data++;
+			len--;
+			if (patch.arg_count == (patch.op == PATCH_OP_INSERT ? 4 : 8)) {
+				if (patch.op == PATCH_OP_INSERT) {
+					patch.offset = 0;
+					patch.left = get_le_uint32(patch.args);
+				} else {
+					patch.offset = get_le_uint32(patch.args);
+					patch.left = get_le_uint32(patch.args + 4);
+					if (patch.offset > patch.old_len || patch.left > patch.old_len - patch.offset) {
+						patch.error = UZLIB_DATA_ERROR;
+					}
+				}
+				// copies need no data, so run straight away
+				if (patch.op == PATCH_OP_COPY) patch_run_op(NULL, 0);
+				else if (patch.left == 0) patch.op = PATCH_OP_END;
+			}
+		} else {
+			// data for an add or insert
+			used = patch_run_op(data, len);
+			data += used;
+			len -= used;
+		}
+	}
+}
+
+static uint32_t patch_probe(const uint8_t *magic) {
+	return (get_le_uint32(magic) == PATCH_MAGIC);
+}
+
+// read the header and trailer of a patch (or dictionary) file, and
+// check it applies to the installed rom
+static int32_t patch_start(decomp_data *decomp, uint8_t *header, uint32_t size) {
+	uint32_t old_crc;
+
+	ets_memset(&patch, 0, sizeof(patch));
+	patch.out_crc = 0xffffffff;
+	patch.decomp = decomp;
+
+	// header and trailer
+	if (!read_footer(decomp->fd, &patch.new_len, &patch.new_crc)) return UZLIB_DATA_ERROR;
+	FILE_LSEEK(decomp->fd, 0, SPIFFS_SEEK_SET);
+	if (FILE_READ(decomp->fd, (u8_t *)header, size) != size) {
+		return UZLIB_DATA_ERROR;
+	}
+	patch.old_len = get_le_uint32(header + 4);
+	old_crc = get_le_uint32(header + 8);
+
+	// check it applies to the installed rom
+	if (flash_crc32(decomp->rom_addr, patch.old_len) != old_crc) return PATCH_BASE_ERROR;
+	return UZLIB_OK;
+}
+
+// check the new rom
+static int32_t patch_end(void) {
+	if (patch.error != UZLIB_OK) return patch.error;
+	if (!patch.done) return UZLIB_DATA_ERROR;
+	if (patch.out_crc != (patch.new_crc ^ 0xffffffff)) return UZLIB_CHKSUM_ERROR;
+	if (patch.out_len != patch.new_len) return UZLIB_LENGTH_ERROR;
+	return UZLIB_DONE;
+}
+
+static int32_t patch_init(decomp_data *decomp) {
+	uint8_t header[PATCH_HEADER_SIZE];
+	int32_t res = patch_start(decomp, header, sizeof(header));
+	if (res != UZLIB_OK) return res;
+	uzlib_inflate_init(&state.gzip, get_source, patch_put_bytes, decomp, decomp->source);
+	return UZLIB_OK;
+}
+
+static int32_t patch_step(uint32_t budget) {
+	int32_t res = uzlib_inflate_step(&state.gzip, budget);
+	return (patch.error != UZLIB_OK) ? patch.error : res;
+}
+
+static int32_t patch_finish(void) {
+	int32_t res = uzlib_inflate_finish(&state.gzip);
+	if (res != UZLIB_DONE && patch.error == UZLIB_OK) patch.error = res;
+	return patch_end();
+}
+
+////////////////////////////////////////////////////////////////
+/// This code deals with dictionary compressed roms, a zlib
+/// stream for each region of the new rom, with part of the
+/// installed rom as a preset dictionary. Shares the patch
+/// status and output handling.
+///
+
+static uint32_t dict_probe(const uint8_t *magic) {
+	return (get_le_uint32(magic) == DICT_MAGIC);
+}
+
+void dict_put_bytes(void *cb_data, uint8_t *data, uint32_t len) {
+	patch_output(data, len);
+}
+
+// prime uzlib with the dictionary for the next region, the dictionary
+// size bytes of the installed rom up to the end of the region
+static void dict_start_region(void) {
+	uint32_t end, start;
+	patch.region_start = patch.out_len;
+	end = MIN(patch.region_start + patch.region_size, patch.old_len);
+	start = (end > patch.dict_size) ? end - patch.dict_size : 0;
+	while (start < end) {
+		uint32_t next = MIN(end - start, BUFFER_SIZE);
+		uzlib_inflate_set_dict(&state.gzip, patch_read_rom(start, next), next);
+		start += next;
+	}
+}
+
+static int32_t dict_header(decomp_data *decomp) {
+	uint8_t header[DICT_HEADER_SIZE];
+	int32_t res = patch_start(decomp, header, sizeof(header));
+	if (res != UZLIB_OK) return res;
+	patch.region_size = get_le_uint32(header + 12);
+	patch.dict_size = get_le_uint32(header + 16);
+	if (patch.region_size == 0) return UZLIB_DATA_ERROR;
+	return UZLIB_OK;
+}
+
+static int32_t dict_init(decomp_data *decomp) {
+	int32_t res = dict_header(decomp);
+	if (res != UZLIB_OK) return res;
+	uzlib_inflate_init(&state.gzip, get_source, dict_put_bytes, decomp, decomp->source);
+	dict_start_region();
+	return UZLIB_OK;
+}
+
+static int32_t dict_step(uint32_t budget) {
+	int32_t res = uzlib_inflate_step(&state.gzip, budget);
+	if (res == UZLIB_DONE) {
+		// end of the stream for this region, check it and start the next
+		res = uzlib_inflate_finish(&state.gzip);
+		if (res == UZLIB_DONE && patch.out_len != MIN(patch.region_start + patch.region_size, patch.new_len)) {
+			res = UZLIB_LENGTH_ERROR;
+		}
+		if (res == UZLIB_DONE && patch.out_len < patch.new_len) {
+			uzlib_inflate_next(&state.gzip);
+			dict_start_region();
+			res = UZLIB_OK;
+		} else if (res == UZLIB_DONE) {
+			patch.done = TRUE;
+		}
+	}
+	return (patch.error != UZLIB_OK) ? patch.error : res;
+}
+
+static int32_t dict_finish(void) {
+	return patch_end();
+}
+
+// can be resumed between regions, before the next stream has started,
+// as each starts afresh with its dictionary from the installed rom
+static uint32_t dict_sync(decomp_data *decomp, install_journal *journal) {
+	if (state.gzip.header_done || patch.done) return FALSE;
+	journal->in_pos = FILE_TELL(decomp->fd) - (state.gzip.source_len - state.gzip.source_pos);
+	journal->out_len = patch.out_len;
+	journal->out_crc = patch.out_crc;
+	return TRUE;
+}
+
+static int32_t dict_resume(decomp_data *decomp, install_journal *journal) {
+	int32_t res = dict_header(decomp);
+	if (res != UZLIB_OK) return res;
+	patch.out_len = journal->out_len;
+	patch.out_crc = journal->out_crc;
+	if (FILE_LSEEK(decomp->fd, journal->in_pos, SPIFFS_SEEK_SET) < 0) return UZLIB_DATA_ERROR;
+	uzlib_inflate_init(&state.gzip, get_source, dict_put_bytes, decomp, decomp->source);
+	dict_start_region();
+	return UZLIB_OK;
+}
+
+// supported ota file formats, patches can't be resumed as the uzlib
+// window holds patch ops, rather than output that can be read back
+static const decomp_codec codecs[] = {
+	{ gzip_probe, read_footer, gzip_init, gzip_step, gzip_finish, FALSE, gzip_sync, gzip_resume },
+	{ lz4_probe, read_footer, lz4_init, lz4_step, lz4_finish, FALSE, lz4_sync, lz4_resume },
+	{ patch_probe, read_footer, patch_init, patch_step, patch_finish, TRUE, NULL, NULL },
+	{ dict_probe, read_footer, dict_init, dict_step, dict_finish, TRUE, dict_sync, dict_resume },
+};
+
+// find the codec for an ota file, from the magic bytes at the start
+static const decomp_codec *find_codec(spiffs_file fd) {
+	uint8_t magic[4];
+	uint32_t loop;
+	if (FILE_READ(fd, (u8_t *)magic, sizeof(magic)) != sizeof(magic)) return NULL;
+	FILE_LSEEK(fd, 0, SPIFFS_SEEK_SET);
+	for (loop = 0; loop < sizeof(codecs) / sizeof(codecs[0]); loop++) {
+		if (codecs[loop].probe(magic)) return &codecs[loop];
+	}
+	return NULL;
 }
 
 ////////////////////////////////////////////////////////////////
@@ -190,100 +906,456 @@ void put_bytes(void *cb_data, uint8_t *data, uint32_t len) {
 // if you want to use some kind of dynamic partition
 // layout replace this function with appropriate code
 void get_partitions(partition_info *parts) {
-	parts->boot_offset = BOOT_IMAGE_OFFSET;
+	parts->config_offset[0] = BOOT_CONFIG_OFFSET;
+	parts->config_offset[1] = BOOT_CONFIG_COPY_OFFSET;
+	parts->journal_offset = BOOT_JOURNAL_OFFSET;
+	parts->slot_offset[0] = BOOT_SLOT_A_OFFSET;
+	parts->slot_offset[1] = BOOT_SLOT_B_OFFSET;
+	parts->slot_size = BOOT_SLOT_SIZE;
+	parts->loader_size = BOOT_LOADER_SIZE;
 	parts->spiffs_offset = BOOT_SPIFFS_OFFSET;
 	parts->spiffs_size = BOOT_SPIFFS_SIZE;
 }
 
-static uint32_t perform_update(partition_info *parts) {
+// crc32 of the config fields from start up to end
+static uint32_t config_crc(void *start, void *end) {
+	return uzlib_crc32((uint8_t*)start, (uint8_t*)end - (uint8_t*)start, 0xffffffff) ^ 0xffffffff;
+}
+
+// the copy of the boot config that is current, the next write goes to
+// the other
+static uint32_t config_copy;
+
+// read a copy of the boot config, returns true if it is valid
+static uint32_t read_config_copy(uint32_t addr, boot_config *config) {
+	flash_read(addr, config, sizeof(*config));
+	return (config->magic == BOOT_CONFIG_MAGIC && config->slot < BOOT_SLOTS
+		&& config->crc == config_crc(config, &config->crc));
+}
+
+// read the boot config, the valid copy with the higher sequence number,
+// if there isn't a valid one boot slot a, returns true if there was
+static uint32_t read_config(partition_info *parts, boot_config *config) {
+	boot_config other;
+	uint32_t valid = read_config_copy(parts->config_offset[0], config);
+	config_copy = 0;
+	if (read_config_copy(parts->config_offset[1], &other)
+		&& (!valid || (int32_t)(other.seq - config->seq) > 0)) {
+		ets_memcpy(config, &other, sizeof(other));
+		config_copy = 1;
+		valid = TRUE;
+	}
+	if (!valid) {
+		ets_printf("No valid boot config, using slot a.\n");
+		config->seq = 0;
+		config->slot = 0;
+		ets_memset(config->rom_len, 0, sizeof(config->rom_len));
+		return FALSE;
+	}
+	if (config->rom_check != config_crc(config->rom_len, &config->rom_check)) {
+		// no record of the installed roms (e.g. written by the user rom)
+		ets_memset(config->rom_len, 0, sizeof(config->rom_len));
+	}
+	return TRUE;
+}
+
+// true if the update pending flag is set in the config sector at addr
+static uint32_t read_flag_at(uint32_t addr) {
+	uint32_t flag;
+	flash_read(addr + BOOT_UPDATE_FLAG_OFFSET, &flag, sizeof(flag));
+	return (flag != 0xffffffff);
+}
+
+// true if the user rom has set the update pending flag, in either copy
+static uint32_t read_update_flag(partition_info *parts) {
+	return (read_flag_at(parts->config_offset[0]) || read_flag_at(parts->config_offset[1]));
+}
+
+// write the boot config, if it has changed, to the copy that isn't
+// current, so the current one is kept if the write doesn't finish, the
+// update pending flag is erased with it so is set in the current copy
+// first, and again afterwards, unless clear is set, when it is erased
+// from both copies
+static void write_config(partition_info *parts, boot_config *config, uint32_t clear) {
+	boot_config current;
+	uint32_t flag = 0;
+	uint32_t pending = read_update_flag(parts);
+	uint32_t next = (config_copy + 1) % BOOT_CONFIG_COPIES;
+	config->magic = BOOT_CONFIG_MAGIC;
+	config->crc = config_crc(config, &config->crc);
+	config->rom_check = config_crc(config->rom_len, &config->rom_check);
+	if (read_config_copy(parts->config_offset[config_copy], &current)
+		&& !ets_memcmp(&current, config, sizeof(current)) && !(clear && pending)) {
+		// no change
+		return;
+	}
+	config->seq++;
+	config->crc = config_crc(config, &config->crc);
+	if (pending && !clear) {
+		flash_program_start(parts->config_offset[config_copy] + BOOT_UPDATE_FLAG_OFFSET, (uint8_t*)&flag, sizeof(flag));
+	}
+	flash_erase_start(parts->config_offset[next], SECTOR_SIZE);
+	flash_program_start(parts->config_offset[next], (uint8_t*)config, sizeof(*config));
+	if (pending && !clear) {
+		flash_program_start(parts->config_offset[next] + BOOT_UPDATE_FLAG_OFFSET, (uint8_t*)&flag, sizeof(flag));
+	}
+	flash_wait();
+	if (clear && read_flag_at(parts->config_offset[config_copy])) {
+		// the new copy is complete, so the old one can go with the flag
+		flash_erase_start(parts->config_offset[config_copy], SECTOR_SIZE);
+		flash_wait();
+	}
+	config_copy = next;
+}
+
+#ifdef BOOT_INSTALL_JOURNAL
+// read the journal, returns true if it has a checkpoint for the same
+// install, with the output up to it intact, and fills in the rest
+static uint32_t read_journal(partition_info *parts, install_journal *journal) {
+	install_journal saved;
+	flash_read(parts->journal_offset, &saved, sizeof(saved));
+	if (saved.magic != BOOT_JOURNAL_MAGIC
+		|| saved.crc != (uzlib_crc32((uint8_t*)&saved, sizeof(saved) - sizeof(saved.crc), 0xffffffff) ^ 0xffffffff)
+		|| saved.addr != journal->addr || saved.codec != journal->codec
+		|| saved.new_len != journal->new_len || saved.new_crc != journal->new_crc
+		|| saved.out_len > saved.new_len
+		|| flash_crc32(saved.addr, saved.out_len) != (saved.out_crc ^ 0xffffffff)) {
+		return FALSE;
+	}
+	ets_memcpy(journal, &saved, sizeof(saved));
+	return TRUE;
+}
+
+// save a checkpoint, left to finish in the background, if it doesn't
+// the crc won't match and the previous one is lost, so the install
+// starts again
+static void write_journal(partition_info *parts, install_journal *journal) {
+	journal->magic = BOOT_JOURNAL_MAGIC;
+	journal->crc = uzlib_crc32((uint8_t*)journal, sizeof(*journal) - sizeof(journal->crc), 0xffffffff) ^ 0xffffffff;
+	flash_erase_start(parts->journal_offset, SECTOR_SIZE);
+	flash_program_start(parts->journal_offset, (uint8_t*)journal, sizeof(*journal));
+}
+#endif
+
+// decompress the whole ota file, a step at a time, to the address in
+// the journal, carrying on from the checkpoint in the journal sector if
+// it is for the same install, and saving checkpoints along the way,
+// in_place if the target holds data to be overwritten, not an empty slot
+static int32_t decompress(const decomp_codec *codec, decomp_data *decomp, partition_info *parts, install_journal *journal, uint32_t in_place) {
+	int32_t res;
+#ifdef BOOT_INSTALL_JOURNAL
+	uint32_t checkpoint;
+	if (codec->resume && read_journal(parts, journal)) {
+		ets_printf("resuming at 0x%x... ", journal->out_len);
+		flash_write_resume(&decomp->flasher, journal->addr, journal->new_len, journal->out_len, in_place);
+		res = codec->resume(decomp, journal);
+	} else
+#endif
+	{
+		flash_write_init(&decomp->flasher, journal->addr, journal->new_len, in_place);
+		res = codec->init(decomp);
+	}
+	if (res != UZLIB_OK) return res;
+#ifdef BOOT_INSTALL_JOURNAL
+	checkpoint = journal->out_len + JOURNAL_INTERVAL;
+#endif
+	while ((res = codec->step(INFLATE_STEP)) == UZLIB_OK && !decomp->flasher.overrun) {
+		// control comes back here between steps, to allow
+		// other work to be interleaved with the decompression
+#ifdef BOOT_INSTALL_JOURNAL
+		flash_write_status *flasher = &decomp->flasher;
+		if (codec->sync && flasher->start_addr - flasher->base_addr + flasher->count >= checkpoint
+			&& codec->sync(decomp, journal) && flash_write_flush(flasher)) {
+			write_journal(parts, journal);
+			checkpoint = journal->out_len + JOURNAL_INTERVAL;
+		}
+#endif
+	}
+	// more output than expected, the rest wasn't written
+	if (decomp->flasher.overrun) return UZLIB_LENGTH_ERROR;
+	if (res == UZLIB_DONE) res = codec->finish();
+	return res;
+}
+
+// check the file against its integrity trailer, if it has one, by
+// reading it through the crc32, much quicker than decompressing it, so
+// a corrupt file is rejected before anything is erased, returns false
+// if the trailer is there and doesn't match
+static uint32_t check_file(spiffs_file fd, uint8_t *buffer, uint32_t size) {
+	uint8_t trailer[CHECK_TRAILER_SIZE];
+	int32_t file_len = FILE_LSEEK(fd, 0, SPIFFS_SEEK_END);
+	uint32_t crc = 0xffffffff;
+	uint32_t len;
+	if (file_len < CHECK_TRAILER_SIZE
+		|| FILE_LSEEK(fd, file_len - CHECK_TRAILER_SIZE, SPIFFS_SEEK_SET) < 0
+		|| FILE_READ(fd, (u8_t *)trailer, sizeof(trailer)) != sizeof(trailer)
+		|| get_le_uint32(trailer) != CHECK_MAGIC) {
+		// no trailer
+		return TRUE;
+	}
+	len = get_le_uint32(trailer + 8);
+	if (len != file_len - CHECK_TRAILER_SIZE) return FALSE;
+	FILE_LSEEK(fd, 0, SPIFFS_SEEK_SET);
+	while (len > 0) {
+		int32_t read = FILE_READ(fd, (u8_t *)buffer, MIN(len, size));
+		if (read <= 0) return FALSE;
+		crc = uzlib_crc32(buffer, read, crc);
+		len -= read;
+	}
+	return (get_le_uint32(trailer + 4) == (crc ^ 0xffffffff));
+}
+
+// check a rom fits in its slot, and the slot in the flash, on a smaller
+// flash than the layout needs the address would wrap round, e.g. onto
+// the other slot, which may be the one booted
+static uint32_t valid_slot(partition_info *parts, uint32_t addr, uint32_t len) {
+	return (len <= parts->slot_size && flash_size != 0 && addr + len <= flash_size);
+}
+
+// true if the area from target to end overlaps size bytes from start
+static uint32_t overlaps(uint32_t target, uint32_t end, uint32_t start, uint32_t size) {
+	return (end > start && target < start + size);
+}
+
+// check a data target is sector aligned, within the flash, and clear of
+// sBoot itself, the rom slots (either could be booted), and the areas
+// sBoot uses while installing
+static uint32_t valid_target(partition_info *parts, uint32_t target, uint32_t len) {
+	uint32_t end = target + len;
+	uint32_t loop;
+	if ((target % SECTOR_SIZE) != 0 || end < target || flash_size == 0 || end > flash_size
+		|| overlaps(target, end, 0, parts->loader_size)
+		|| overlaps(target, end, parts->spiffs_offset, parts->spiffs_size)
+		|| overlaps(target, end, parts->journal_offset, SECTOR_SIZE)) {
+		return FALSE;
+	}
+	for (loop = 0; loop < BOOT_SLOTS; loop++) {
+		if (overlaps(target, end, parts->slot_offset[loop], parts->slot_size)) return FALSE;
+	}
+	for (loop = 0; loop < BOOT_CONFIG_COPIES; loop++) {
+		if (overlaps(target, end, parts->config_offset[loop], SECTOR_SIZE)) return FALSE;
+	}
+	return TRUE;
+}
+
+// install an update, a rom goes to the slot that isn't booted, in a
+// single pass, the booted rom is left alone until the new one has been
+// checked, and then the boot config is switched to the new slot, other
+// data is written straight to its target
+static uint32_t perform_update(partition_info *parts, boot_config *config, update_entry *entry) {
 
 	uint32_t ret = FALSE;
-	decomp_data decomp;
+	// static as it holds the source and flash sector buffers
+	static decomp_data decomp;
+	const decomp_codec *codec;
 
-	ets_printf("Testing new rom... ");
 	// open ota file
-	decomp.fd = SPIFFS_open(&fs, BOOT_OTA_FILE, SPIFFS_RDONLY, 0);
+	decomp.fd = FILE_OPEN(entry->name);
+#ifdef BOOT_SPIFFS_LITE
+	// find all its pages now, so it can be read a run of pages at a time
+	if (decomp.fd >= 0) spiffs_lite_map(&fs, decomp.fd, decomp.map, OTA_MAP_PAGES);
+#endif
 	if (decomp.fd < 0) {
 		ets_printf("spiffs open error %d\n", decomp.fd);
+	} else if ((codec = find_codec(decomp.fd)) == NULL) {
+		ets_printf("Unknown ota file type.\n");
+		FILE_CLOSE(decomp.fd);
 	} else {
-		// dry run to check file decompresses ok
-		decomp.dry_run = 1;
-		uint32_t res = uzlib_inflate(get_source, put_bytes, &decomp, decomp.source);
+		int32_t res = UZLIB_DONE;
+		uint32_t slot = (config->slot + 1) % BOOT_SLOTS;
+		// compare sectors before erasing them, rather than erasing ahead,
+		// for data targets, and for a rom built from the booted one, as
+		// the slot then usually holds the rom before that, which shares
+		// most of its sectors, a full rom seldom does, so isn't compared
+		uint32_t in_place = (entry->target != MANIFEST_ROM || codec->uses_rom);
+		install_journal journal;
+		ets_memset(&journal, 0, sizeof(journal));
+		journal.codec = codec - codecs;
+		decomp.rom_addr = parts->slot_offset[config->slot];
+		if (entry->target == MANIFEST_ROM) {
+			journal.addr = parts->slot_offset[slot];
+			ets_printf("Installing new rom to slot %c... ", 'a' + slot);
+			if (!valid_slot(parts, journal.addr, entry->len)) res = SLOT_ERROR;
+		} else {
+			journal.addr = entry->target;
+			ets_printf("Installing %s to 0x%08x... ", entry->name, entry->target);
+			if (codec->uses_rom || !valid_target(parts, entry->target, entry->len)) res = MANIFEST_ERROR;
+		}
+		// expected length of the new data, the area to erase
+		if (!codec->expected(decomp.fd, &journal.new_len, &journal.new_crc)) res = UZLIB_DATA_ERROR;
+		else if (journal.new_len != entry->len || journal.new_crc != entry->crc) res = MANIFEST_ERROR;
+		else if (res == UZLIB_DONE && !check_file(decomp.fd, decomp.source, sizeof(decomp.source))) res = CHECK_ERROR;
+		FILE_LSEEK(decomp.fd, 0, SPIFFS_SEEK_SET);
 		if (res == UZLIB_DONE) {
-			// real extraction run
-			ets_printf("passed.\nInstalling new rom... ");
-			flash_write_init(&decomp.flasher, parts->boot_offset);
-			SPIFFS_lseek(&fs, decomp.fd, 0, SPIFFS_SEEK_SET);
-			decomp.dry_run = 0;
-			uzlib_inflate(get_source, put_bytes, &decomp, decomp.source);
+			res = decompress(codec, &decomp, parts, &journal, in_place);
 			flash_write_end(&decomp.flasher);
-			ets_printf("complete.\n");
+			// check what was written, as well as what was decompressed
+			if (res == UZLIB_DONE && flash_crc32(journal.addr, journal.new_len) != journal.new_crc) {
+				res = UZLIB_CHKSUM_ERROR;
+			}
+#ifdef BOOT_INSTALL_JOURNAL
+			// finished, one way or the other, so it shouldn't be resumed
+			flash_erase_start(parts->journal_offset, SECTOR_SIZE);
+			flash_wait();
+#endif
+		}
+		if (res == UZLIB_DONE) {
+			if (entry->target == MANIFEST_ROM) {
+				config->slot = slot;
+				config->rom_len[slot] = entry->len;
+				config->rom_crc[slot] = entry->crc;
+				write_config(parts, config, FALSE);
+			}
+			if (in_place) {
+				ets_printf("complete, %d of %d sectors unchanged.\n", decomp.flasher.skipped, decomp.flasher.sectors);
+			} else {
+				ets_printf("complete.\n");
+			}
 			ret = TRUE;
 		} else if (res == UZLIB_CHKSUM_ERROR) ets_printf("failed: bad checksum.\n");
+		else if (res == UZLIB_DICT_ERROR) ets_printf("failed: window too large.\n");
 		else if (res == UZLIB_LENGTH_ERROR) ets_printf("failed: bad length.\n");
+		else if (res == PATCH_BASE_ERROR) ets_printf("failed: patch is not for the installed rom.\n");
+		else if (res == MANIFEST_ERROR) ets_printf("failed: doesn't match the manifest, or bad target.\n");
+		else if (res == CHECK_ERROR) ets_printf("failed: ota file is corrupt.\n");
+		else if (res == SLOT_ERROR) ets_printf("failed: doesn't fit in the slot, or the slot in the flash.\n");
 		else ets_printf("failed: 0x%0x\n", res);
 		// close ota file
-		SPIFFS_close(&fs, decomp.fd);
+		FILE_CLOSE(decomp.fd);
 	}
 	return ret;
 }
 
-// check if update is available
-// returns true if ota file exists and it differs from installed image
-static uint32_t need_update(partition_info *parts) {
-	uint32_t ret = FALSE;
-	uint32_t addr;
-	uint32_t read_len;
-	uint8_t buffer[SECTOR_SIZE];
-	uint32_t ota_len;
-	uint32_t ota_crc;
-	uint32_t rom_crc = 0xffffffff;
+// read the manifest, or if there isn't one make an entry for the ota
+// file on its own, as a rom, with the length and crc32 from its footer
+// returns the number of entries
+static uint32_t read_manifest(update_entry *entries) {
+	uint8_t data[MANIFEST_ENTRY_SIZE];
+	uint32_t count = 0;
+	uint32_t loop;
 	spiffs_file fd;
+	const decomp_codec *codec;
 
 	ets_printf("Checking spiffs for update file... ");
 
-	// open ota file
-	fd = SPIFFS_open(&fs, BOOT_OTA_FILE, SPIFFS_RDONLY, 0);
+	fd = FILE_OPEN(BOOT_MANIFEST_FILE);
+	if (fd >= 0) {
+		if (FILE_READ(fd, (u8_t *)data, MANIFEST_HEADER_SIZE) == MANIFEST_HEADER_SIZE
+			&& get_le_uint32(data) == MANIFEST_MAGIC) {
+			count = get_le_uint32(data + 4);
+		}
+		if (count > MANIFEST_MAX_ENTRIES) count = 0;
+		for (loop = 0; loop < count; loop++) {
+			if (FILE_READ(fd, (u8_t *)data, sizeof(data)) != sizeof(data) || data[sizeof(data) - 1] != 0) {
+				count = 0;
+				break;
+			}
+			entries[loop].target = get_le_uint32(data);
+			entries[loop].len = get_le_uint32(data + 4);
+			entries[loop].crc = get_le_uint32(data + 8);
+			ets_memcpy(entries[loop].name, data + 12, MANIFEST_NAME_LEN);
+		}
+		if (count > 0) ets_printf("found manifest, %d entries.\n", count);
+		else ets_printf("bad manifest.\n");
+		FILE_CLOSE(fd);
+		return count;
+	}
+
+	// no manifest, look for the ota file
+	fd = FILE_OPEN(BOOT_OTA_FILE);
 	if (fd < 0) {
 		if (fd == SPIFFS_ERR_NOT_FOUND) ets_printf("not found.\n");
 		else ets_printf("spiffs open error %d\n", fd);
 	} else {
-		ets_printf("found.\nChecking existing rom... ");
-		// read gzip footer (crc & size)
-		if (SPIFFS_lseek(&fs, fd, -8, SPIFFS_SEEK_END) >= 0) {
-			if (SPIFFS_read(&fs, fd, (u8_t *)buffer, 8) == 8) {
-				ota_crc = buffer[0] | (buffer[1]<<8) | (buffer[2]<<16) | (buffer[3]<<24);
-				ota_len = buffer[4] | (buffer[5]<<8) | (buffer[6]<<16) | (buffer[7]<<24);
-
-				// crc the installed image
-				addr = parts->boot_offset;
-				read_len = (ota_len & 3) ? (ota_len | 3) + 1 : ota_len;
-				while (read_len > 0) {
-					uint32_t read_next = MIN(sizeof(buffer), read_len);
-					SPIRead(addr, buffer, read_next);
-					rom_crc = uzlib_crc32(buffer, MIN(read_next, ota_len), rom_crc);
-					addr += read_next;
-					read_len -= read_next;
-					ota_len -= read_next;
-				}
-				rom_crc ^= 0xffffffff;
-				ret = (ota_crc != rom_crc);
-				if (ret) ets_printf("update needed.\n");
-				else  ets_printf("update not needed.\n");
-			} else {
-				ets_printf("spiffs read error %d\n", SPIFFS_errno(&fs));
-			}
-		} else {
-			ets_printf("spiffs lseek error %d\n", SPIFFS_errno(&fs));
+		ets_printf("found.\n");
+		codec = find_codec(fd);
+		if (codec == NULL) {
+			ets_printf("Unknown ota file type.\n");
+		} else if (codec->expected(fd, &entries[0].len, &entries[0].crc)) {
+			entries[0].target = MANIFEST_ROM;
+			ets_memcpy(entries[0].name, BOOT_OTA_FILE, sizeof(BOOT_OTA_FILE));
+			count = 1;
 		}
-
 		// close ota file
-		SPIFFS_close(&fs, fd);
+		FILE_CLOSE(fd);
 	}
+	return count;
+}
 
+// check if an update is needed, returns true if its target doesn't
+// already hold it, for a rom if it differs from the booted rom
+static uint32_t need_update(partition_info *parts, boot_config *config, update_entry *entry) {
+	uint32_t ret;
+	if (entry->target == MANIFEST_ROM) {
+		uint32_t slot = config->slot;
+		ets_printf("Checking existing rom... ");
+		if (config->rom_len[slot] != 0) {
+			// compare with the record of what was installed
+			ret = (config->rom_len[slot] != entry->len || config->rom_crc[slot] != entry->crc);
+		} else {
+			ret = (flash_crc32(parts->slot_offset[slot], entry->len) != entry->crc);
+			if (!ret) {
+				// record it, so it doesn't need reading again
+				config->rom_len[slot] = entry->len;
+				config->rom_crc[slot] = entry->crc;
+				write_config(parts, config, FALSE);
+			}
+		}
+	} else {
+		ets_printf("Checking %s at 0x%08x... ", entry->name, entry->target);
+		ret = (flash_crc32(entry->target, entry->len) != entry->crc);
+	}
+	if (ret) ets_printf("update needed.\n");
+	else ets_printf("update not needed.\n");
 	return ret;
 }
 
+// install everything in the manifest that isn't already installed, the
+// rom first, the rest only if that works as it is likely to go with the
+// new rom, anything that fails is tried again on the next boot, returns
+// true if there is nothing left to install
+static uint32_t apply_updates(partition_info *parts, boot_config *config) {
+	// static as the names make it quite big for the stack
+	static update_entry entries[MANIFEST_MAX_ENTRIES];
+	uint32_t count = read_manifest(entries);
+	uint32_t pass, loop;
+	uint32_t ret = TRUE;
+	for (pass = 0; pass < 2; pass++) {
+		for (loop = 0; loop < count; loop++) {
+			update_entry *entry = &entries[loop];
+			if ((entry->target == MANIFEST_ROM) != (pass == 0)) continue;
+			if (need_update(parts, config, entry) && !perform_update(parts, config, entry)) {
+				if (pass == 0) return FALSE;
+				ret = FALSE;
+			}
+		}
+	}
+	return ret;
+}
+
+// mount spiffs and install any updates in it
+static void check_updates(partition_info *parts, boot_config *config) {
+	int32_t res = my_spiffs_mount(parts);
+	flash_init();
+	if (res >= 0) {
+#if BOOT_LIST_DIRECTORY
+		// list contents of spiffs
+		list_directory();
+#endif
+		// check for and perform updates from spiffs
+		if (apply_updates(parts, config)) {
+#ifdef BOOT_UPDATE_FLAG
+			// all done, until the user rom saves another
+			write_config(parts, config, TRUE);
+#endif
+		}
+		// unmount the fs
+		my_spiffs_unmount();
+	} else {
+		ets_printf("spiffs mount error: %d\n", res);
+	}
+}
+
 // validate a rom image in flash and find address of rom header
 static uint32_t check_image(uint32_t readpos) {
 
@@ -373,6 +1445,9 @@ static uint32_t check_image(uint32_t readpos) {
 	return romaddr;
 }
 
+// not in the host test build (see test/), which calls check_updates
+#ifndef BOOT_HOST_TEST
+
 // prevent this function being placed inline with main
 // to keep main's stack size as small as possible
 // don't mark as static or it'll be optimised out when
@@ -380,7 +1455,9 @@ static uint32_t check_image(uint32_t readpos) {
 uint32_t NOINLINE real_main(void) {
 
 	uint32_t loadAddr;
+	uint32_t loop;
 	partition_info parts;
+	boot_config config;
 
 #if BOOT_DELAY_MICROS
 	// delay to slow boot (help see messages when debugging)
@@ -389,27 +1466,38 @@ uint32_t NOINLINE real_main(void) {
 
 	ets_printf("\nsBoot v1.0.0 - richardaburton@gmail.com\n");
 
-	// get partition info
+	// get partition info, and the slot to boot
 	get_partitions(&parts);
-	// mount the fs
-	int32_t res = my_spiffs_mount(&parts);
-	if (res >= 0) {
-#if BOOT_LIST_DIRECTORY
-		// list contents of spiffs
-		list_directory();
-#endif
-		// check for and perform update from spiffs
-		if (need_update(&parts)) perform_update(&parts);
-		// unmount the fs
-		SPIFFS_unmount(&fs);
+#ifdef BOOT_UPDATE_FLAG
+	// only look in spiffs when the user rom has saved an update there,
+	// or there's no boot config yet
+	if (read_config(&parts, &config) && !read_update_flag(&parts)) {
+		ets_printf("No update pending.\n");
 	} else {
-		ets_printf("spiffs mount error: %d\n", res);
+		check_updates(&parts, &config);
 	}
+#else
+	read_config(&parts, &config);
+	check_updates(&parts, &config);
+#endif
 
-	// check rom image
-	loadAddr = check_image(BOOT_IMAGE_OFFSET);
-	if (loadAddr == 0) ets_printf("No bootable rom found at 0x%08x.\n", parts.boot_offset);
-	else ets_printf("Booting rom at 0x%08x.\n", loadAddr);
+	// check rom image, falling back to the other slot
+	for (loop = 0; loop < BOOT_SLOTS; loop++) {
+		uint32_t slot = (config.slot + loop) % BOOT_SLOTS;
+		loadAddr = check_image(parts.slot_offset[slot]);
+		if (loadAddr != 0) {
+			ets_printf("Booting rom at 0x%08x (slot %c).\n", loadAddr, 'a' + slot);
+			// record a fall back, so the user rom knows its slot
+			if (slot != config.slot) {
+				config.slot = slot;
+				// an install may have been left unfinished there
+				config.rom_len[slot] = 0;
+				write_config(&parts, &config, FALSE);
+			}
+			break;
+		}
+		ets_printf("No bootable rom found at 0x%08x.\n", parts.slot_offset[slot]);
+	}
 	// copy the loader to top of iram
 	ets_memcpy((void*)_text_addr, _text_data, _text_len);
 	// return address to load from
@@ -432,3 +1520,4 @@ void call_user_start(void) {
 	);
 }
 
+#endif
@@ -22,10 +22,41 @@ extern "C" {
 // uncomment to list the contents of the spiffs on boot
 #define BOOT_LIST_DIRECTORY 1
 
+// uncomment to read spiffs with sBoot's own read only reader, rather
+// than mounting it with the spiffs library, which scans the whole
+// filesystem first, the reader finds the ota file with a single pass
+// over the lookup pages that stops when it is found
+#define BOOT_SPIFFS_LITE 1
+
+// uncomment to cache spiffs reads a sector at a time, in this many
+// sectors of ram, so the many small reads of lookup pages and page
+// headers are served from ram, reads of a page or more only use it if
+// their sector is already there, the hit and miss counts are shown after
+// checking for updates (fewer, but larger, reads of the flash)
+//#define BOOT_SPI_CACHE_SECTORS 2
+
+// uncomment to serve back references older than the decompression
+// window by reading the new rom back from flash, as it is written, so
+// a small window (e.g. make WINDOW_BITS=12) can be used with any file
+//#define BOOT_FLASH_WINDOW 1
+
+// uncomment to resume an install interrupted by a reset or power
+// failure from its last checkpoint, rather than starting again, the
+// checkpoints are saved in the install journal sector (below)
+#define BOOT_INSTALL_JOURNAL 1
+
+// uncomment to only mount spiffs and look for updates when the user
+// rom has set the update pending flag (below), rather than on every boot
+#define BOOT_UPDATE_FLAG 1
+
 // ota file to check for in spiffs
 #define BOOT_OTA_FILE "testload.gz"
 
-// next 3 can be hard coded, or provide an alternative
+// manifest to check for in spiffs, if it is there the files it lists
+// are installed instead of the ota file (see sboot-ota.h)
+#define BOOT_MANIFEST_FILE "manifest.sbm"
+
+// next 9 can be hard coded, or provide an alternative
 // get_partitions function in sboot.c
 // 
 // offset of spiffs in flash
@@ -34,9 +65,68 @@ extern "C" {
 // spiffs size
 #define BOOT_SPIFFS_SIZE (1024*100)
 //
-// offset of rom image in flash
-#define BOOT_IMAGE_OFFSET 0xa0000
+// offsets of the two boot config sectors, each holds a copy of the
+// boot config, written in turn, so if a write doesn't finish (e.g. a
+// reset between the erase and the program) the other is still there
+#define BOOT_CONFIG_OFFSET 0x9f000
+#define BOOT_CONFIG_COPY_OFFSET 0x9d000
+//
+// offset of the install journal sector
+#define BOOT_JOURNAL_OFFSET 0x9e000
+//
+// offsets of the two rom slots, an update is installed to the slot
+// that isn't booted, and the new rom booted once it has been checked
+// each slot must be at the same offset in a different 1MB bank of the
+// flash, the bank is mapped when booting so the same rom runs from
+// either slot, link roms for the offset within the bank
+// so this needs at least 2MB of flash, an install is refused if the
+// flash (from its jedec id) is too small for the slot
+#define BOOT_SLOT_A_OFFSET 0xa0000
+#define BOOT_SLOT_B_OFFSET 0x1a0000
+//
+// size of each rom slot, the largest rom that can be installed, it
+// must end within the bank, this leaves the last 5 sectors of it, where
+// the sdk keeps its data on a 2MB flash
+#define BOOT_SLOT_SIZE 0x5b000
+//
+// space at the start of the flash kept for sBoot itself, check the size
+// of the built sboot.bin fits, it depends on the options above
+#define BOOT_LOADER_SIZE 0x8000
+
+// number of rom slots
+#define BOOT_SLOTS 2
+
+// boot config, the first bytes of each boot config sector, the valid
+// copy with the higher sequence number is the current one, can be read
+// by the user rom to find out which slot it is running from, or written
+// to boot a rom it has written to the other slot itself, to the copy
+// that isn't current, with the sequence number one more
+#define BOOT_CONFIG_MAGIC 0x43624273 // "sBbC"
+typedef struct {
+	uint32_t magic;
+	// incremented with each write
+	uint32_t seq;
+	// slot to boot, 0 for a, 1 for b
+	uint32_t slot;
+	// crc32 of the fields above
+	uint32_t crc;
+	// length and crc32 of the rom in each slot, recorded by sBoot once
+	// it has been checked, so looking for an update doesn't have to read
+	// the whole rom, a zero length if not known (a user rom that writes
+	// a slot itself must zero it, or just not write the record)
+	uint32_t rom_len[BOOT_SLOTS];
+	uint32_t rom_crc[BOOT_SLOTS];
+	// crc32 of the record above, kept separate so a config written by
+	// the user rom with just the first four fields is still valid
+	uint32_t rom_check;
+} boot_config;
 
+// update pending flag, a word in the boot config sectors, at this offset
+// from their start, erased (0xffffffff) when clear, the user rom sets it
+// by writing zero (no erase needed) in the first (BOOT_CONFIG_OFFSET)
+// after saving an update to spiffs, it is set if set in either, sBoot
+// clears it once there is nothing left to install
+#define BOOT_UPDATE_FLAG_OFFSET 0x100
 
 #ifdef __cplusplus
 }
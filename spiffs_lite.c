@@ -0,0 +1,339 @@
+//////////////////////////////////////////////////
+// Read only spiffs access for sBoot.
+// Copyright 2015-2019 Richard A Burton
+// richardaburton@gmail.com
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+#include "spiffs_lite.h"
+// for the on flash format
+#include <spiffs_nucleus.h>
+
+#define MIN(a,b) ((a)<(b) ? (a):(b))
+
+// object lookup entries in the largest page supported
+#define LU_PAGE_ENTRIES (SPIFFS_LITE_PAGE_SIZE / sizeof(spiffs_obj_id))
+
+// check of an object lookup entry, returns 1 for a match, 0 to carry on
+// looking, or an error
+typedef s32_t (*lu_check)(spiffs_lite *lfs, spiffs_obj_id obj_id, spiffs_page_ix pix, const void *arg);
+
+// object id and span index of an object index page to find
+typedef struct {
+	spiffs_obj_id obj_id;
+	spiffs_span_ix span_ix;
+} ix_key;
+
+// all reads are from a word aligned address, to a word aligned buffer,
+// as the hal (on top of SPIRead) requires
+static s32_t hal_read(spiffs_lite *lfs, u32_t addr, u32_t size, void *dst) {
+	s32_t res = lfs->fs.cfg.hal_read_f(addr, size, (u8_t*)dst);
+	if (res < SPIFFS_OK) lfs->err = res;
+	return res;
+}
+
+// find the next object lookup entry that passes the check, from block
+// and entry on, returns its page index and leaves entry just past it,
+// blocks without the magic (i.e. with an erase interrupted) are skipped
+static s32_t lu_find(spiffs_lite *lfs, spiffs_block_ix *block, int *entry, lu_check check, const void *arg) {
+	spiffs *fs = &lfs->fs;
+	spiffs_obj_id lu[LU_PAGE_ENTRIES] __attribute__ ((aligned (4)));
+	const int per_page = SPIFFS_CFG_LOG_PAGE_SZ(fs) / sizeof(spiffs_obj_id);
+	for (; *block < fs->block_count; (*block)++, *entry = 0) {
+		spiffs_obj_id magic;
+		if (hal_read(lfs, SPIFFS_MAGIC_PADDR(fs, *block), sizeof(magic), &magic) < SPIFFS_OK) return lfs->err;
+		if (magic != SPIFFS_MAGIC(fs, *block)) continue;
+		while (*entry < SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs)) {
+			// the entries in the rest of this lookup page
+			int first = *entry - *entry % per_page;
+			int count = MIN(per_page, SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs) - first);
+			if (hal_read(lfs, SPIFFS_BLOCK_TO_PADDR(fs, *block) + first * sizeof(spiffs_obj_id),
+				count * sizeof(spiffs_obj_id), lu) < SPIFFS_OK) return lfs->err;
+			for (; *entry < first + count; (*entry)++) {
+				spiffs_obj_id obj_id = lu[*entry - first];
+				spiffs_page_ix pix;
+				s32_t res;
+				if (obj_id == SPIFFS_OBJ_ID_FREE || obj_id == SPIFFS_OBJ_ID_DELETED) continue;
+				pix = SPIFFS_OBJ_LOOKUP_ENTRY_TO_PIX(fs, *block, *entry);
+				res = check(lfs, obj_id, pix, arg);
+				if (res != 0) {
+					(*entry)++;
+					return (res < 0 ? res : pix);
+				}
+			}
+		}
+	}
+	return SPIFFS_ERR_NOT_FOUND;
+}
+
+// an object index header, of a file that isn't being deleted, with the
+// name in arg, or any name if that is null
+static s32_t check_name(spiffs_lite *lfs, spiffs_obj_id obj_id, spiffs_page_ix pix, const void *arg) {
+	spiffs_page_object_ix_header hdr __attribute__ ((aligned (4)));
+	if ((obj_id & SPIFFS_OBJ_ID_IX_FLAG) == 0) return 0;
+	if (hal_read(lfs, SPIFFS_PAGE_TO_PADDR(&lfs->fs, pix), sizeof(hdr), &hdr) < SPIFFS_OK) return lfs->err;
+	return (hdr.p_hdr.span_ix == 0
+		&& (hdr.p_hdr.flags & (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_IXDELE))
+			== (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_IXDELE)
+		&& (arg == NULL || strncmp((const char*)hdr.name, (const char*)arg, SPIFFS_OBJ_NAME_LEN) == 0));
+}
+
+// the object index page with the object id and span index in arg
+static s32_t check_ix(spiffs_lite *lfs, spiffs_obj_id obj_id, spiffs_page_ix pix, const void *arg) {
+	const ix_key *key = (const ix_key*)arg;
+	spiffs_page_header ph __attribute__ ((aligned (4)));
+	if (obj_id != (key->obj_id | SPIFFS_OBJ_ID_IX_FLAG)) return 0;
+	if (hal_read(lfs, SPIFFS_PAGE_TO_PADDR(&lfs->fs, pix), sizeof(ph), &ph) < SPIFFS_OK) return lfs->err;
+	return (ph.span_ix == key->span_ix
+		&& (ph.flags & (SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_USED)) == SPIFFS_PH_FLAG_DELET);
+}
+
+// any of the object index pages after the header with the object id in
+// arg, up to its span index
+static s32_t check_ix_any(spiffs_lite *lfs, spiffs_obj_id obj_id, spiffs_page_ix pix, const void *arg) {
+	const ix_key *key = (const ix_key*)arg;
+	spiffs_page_header ph __attribute__ ((aligned (4)));
+	if (obj_id != (key->obj_id | SPIFFS_OBJ_ID_IX_FLAG)) return 0;
+	if (hal_read(lfs, SPIFFS_PAGE_TO_PADDR(&lfs->fs, pix), sizeof(ph), &ph) < SPIFFS_OK) return lfs->err;
+	return (ph.span_ix != 0 && ph.span_ix <= key->span_ix
+		&& (ph.flags & (SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_USED)) == SPIFFS_PH_FLAG_DELET);
+}
+
+static spiffs_lite_fd *get_fd(spiffs_lite *lfs, spiffs_file fh) {
+	if (fh < 1 || fh > SPIFFS_LITE_FILES || lfs->fds[fh - 1].obj_id == 0) {
+		lfs->err = SPIFFS_ERR_BAD_DESCRIPTOR;
+		return NULL;
+	}
+	return &lfs->fds[fh - 1];
+}
+
+// page index of a data page of the file, from the object index page that
+// has it, which is found and read first if it isn't the one already read
+static s32_t data_pix(spiffs_lite *lfs, spiffs_lite_fd *fd, spiffs_span_ix data_spix) {
+	spiffs *fs = &lfs->fs;
+	spiffs_span_ix ix_spix = SPIFFS_OBJ_IX_ENTRY_SPAN_IX(fs, data_spix);
+	spiffs_page_ix pix;
+	if (data_spix < fd->map_entries && fd->map[data_spix] != (spiffs_page_ix)-1) {
+		return fd->map[data_spix];
+	}
+	if (fd->ix_spix != ix_spix) {
+		s32_t res = fd->hdr_pix;
+		if (ix_spix != 0) {
+			spiffs_block_ix block = 0;
+			int entry = 0;
+			ix_key key = { fd->obj_id, ix_spix };
+			res = lu_find(lfs, &block, &entry, check_ix, &key);
+			if (res < 0) return res;
+		}
+		if (hal_read(lfs, SPIFFS_PAGE_TO_PADDR(fs, res), SPIFFS_CFG_LOG_PAGE_SZ(fs), fd->ix_page) < SPIFFS_OK) {
+			// nothing valid in it now
+			fd->ix_spix = (spiffs_span_ix)-1;
+			return lfs->err;
+		}
+		fd->ix_spix = ix_spix;
+	}
+	if (ix_spix == 0) {
+		pix = ((spiffs_page_ix*)(fd->ix_page + sizeof(spiffs_page_object_ix_header)))[SPIFFS_OBJ_IX_ENTRY(fs, data_spix)];
+	} else {
+		pix = ((spiffs_page_ix*)(fd->ix_page + sizeof(spiffs_page_object_ix)))[SPIFFS_OBJ_IX_ENTRY(fs, data_spix)];
+	}
+	if (pix == (spiffs_page_ix)-1 || pix >= fs->block_count * SPIFFS_PAGES_PER_BLOCK(fs)) return SPIFFS_ERR_INDEX_INVALID;
+	return pix;
+}
+
+// read a run of data pages next to each other in flash, from the one at
+// pix, with span index spix, straight into dst, then move the data up
+// over the page headers, skipping offset bytes of the first page
+// returns the number of bytes of data
+static s32_t read_run(spiffs_lite *lfs, spiffs_lite_fd *fd, spiffs_page_ix pix, spiffs_span_ix spix,
+	u32_t pages, u32_t offset, u8_t *dst) {
+	spiffs *fs = &lfs->fs;
+	u8_t *out = dst;
+	u32_t loop;
+	if (hal_read(lfs, SPIFFS_PAGE_TO_PADDR(fs, pix), pages * SPIFFS_CFG_LOG_PAGE_SZ(fs), dst) < SPIFFS_OK) return lfs->err;
+	for (loop = 0; loop < pages; loop++) {
+		// data already moved stops short of this page's header
+		u8_t *page = dst + loop * SPIFFS_CFG_LOG_PAGE_SZ(fs);
+		spiffs_page_header *ph = (spiffs_page_header*)page;
+		if (ph->obj_id != fd->obj_id || ph->span_ix != spix + loop) return SPIFFS_ERR_INDEX_INVALID;
+		memmove(out, page + sizeof(spiffs_page_header) + offset, SPIFFS_DATA_PAGE_SIZE(fs) - offset);
+		out += SPIFFS_DATA_PAGE_SIZE(fs) - offset;
+		offset = 0;
+	}
+	return out - dst;
+}
+
+s32_t spiffs_lite_mount(spiffs_lite *lfs, spiffs_config *cfg) {
+	spiffs *fs = &lfs->fs;
+	spiffs_block_ix block;
+	memset(lfs, 0, sizeof(*lfs));
+	lfs->page_pix = (spiffs_page_ix)-1;
+	fs->cfg = *cfg;
+	// check it is a config this can read
+	if (cfg->log_page_size == 0 || cfg->log_page_size > SPIFFS_LITE_PAGE_SIZE
+		|| cfg->log_block_size % cfg->log_page_size != 0
+		|| cfg->phys_size < cfg->log_block_size * 2) {
+		return (lfs->err = SPIFFS_ERR_NOT_A_FS);
+	}
+	fs->block_count = cfg->phys_size / cfg->log_block_size;
+	// and that there is a filesystem there, from the magic of the first
+	// block, or the second as spiffs allows one to have an erase interrupted
+	for (block = 0; block < 2; block++) {
+		spiffs_obj_id magic;
+		if (hal_read(lfs, SPIFFS_MAGIC_PADDR(fs, block), sizeof(magic), &magic) < SPIFFS_OK) return lfs->err;
+		if (magic == SPIFFS_MAGIC(fs, block)) return SPIFFS_OK;
+	}
+	return (lfs->err = SPIFFS_ERR_NOT_A_FS);
+}
+
+spiffs_file spiffs_lite_open(spiffs_lite *lfs, const char *path) {
+	spiffs_page_object_ix_header *hdr;
+	spiffs_lite_fd *fd;
+	spiffs_block_ix block = 0;
+	int entry = 0;
+	s32_t pix;
+	int fh;
+	for (fh = 0; fh < SPIFFS_LITE_FILES && lfs->fds[fh].obj_id != 0; fh++);
+	if (fh == SPIFFS_LITE_FILES) return (lfs->err = SPIFFS_ERR_OUT_OF_FILE_DESCS);
+	fd = &lfs->fds[fh];
+	pix = lu_find(lfs, &block, &entry, check_name, path);
+	if (pix < 0) return (lfs->err = pix);
+	// the header is also the first object index page, so keep it
+	if (hal_read(lfs, SPIFFS_PAGE_TO_PADDR(&lfs->fs, pix), SPIFFS_CFG_LOG_PAGE_SZ(&lfs->fs), fd->ix_page) < SPIFFS_OK) return lfs->err;
+	hdr = (spiffs_page_object_ix_header*)fd->ix_page;
+	fd->obj_id = hdr->p_hdr.obj_id & ~SPIFFS_OBJ_ID_IX_FLAG;
+	fd->size = (hdr->size == SPIFFS_UNDEFINED_LEN ? 0 : hdr->size);
+	fd->pos = 0;
+	fd->hdr_pix = pix;
+	fd->ix_spix = 0;
+	fd->map = NULL;
+	fd->map_entries = 0;
+	return fh + 1;
+}
+
+s32_t spiffs_lite_read(spiffs_lite *lfs, spiffs_file fh, void *buf, s32_t len) {
+	spiffs *fs = &lfs->fs;
+	spiffs_lite_fd *fd = get_fd(lfs, fh);
+	u8_t *dst = (u8_t*)buf;
+	s32_t done = 0;
+	if (fd == NULL) return lfs->err;
+	if (fd->pos >= fd->size) return (lfs->err = SPIFFS_ERR_END_OF_OBJECT);
+	len = MIN((u32_t)len, fd->size - fd->pos);
+	while (done < len) {
+		spiffs_span_ix spix = fd->pos / SPIFFS_DATA_PAGE_SIZE(fs);
+		u32_t offset = fd->pos % SPIFFS_DATA_PAGE_SIZE(fs);
+		u32_t count = MIN((u32_t)(len - done), SPIFFS_DATA_PAGE_SIZE(fs) - offset);
+		u32_t pages = 1;
+		s32_t pix = data_pix(lfs, fd, spix);
+		if (pix < 0) return (lfs->err = pix);
+		if (fd->map_entries != 0 && ((uintptr_t)(dst + done) & 3) == 0) {
+			// as many whole pages, next to each other, as the buffer holds
+			u32_t max = (len - done) / SPIFFS_CFG_LOG_PAGE_SZ(fs);
+			while (pages < max && spix + pages < fd->map_entries && fd->map[spix + pages] == pix + pages) pages++;
+		}
+		if (pages > 1) {
+			s32_t res = read_run(lfs, fd, pix, spix, pages, offset, dst + done);
+			if (res < 0) return (lfs->err = res);
+			count = res;
+		} else {
+			// whole pages are read, for the alignment
+			if (pix != lfs->page_pix) {
+				lfs->page_pix = (spiffs_page_ix)-1;
+				if (hal_read(lfs, SPIFFS_PAGE_TO_PADDR(fs, pix), SPIFFS_CFG_LOG_PAGE_SZ(fs), lfs->page) < SPIFFS_OK) return lfs->err;
+				lfs->page_pix = pix;
+			}
+			memcpy(dst + done, lfs->page + sizeof(spiffs_page_header) + offset, count);
+		}
+		done += count;
+		fd->pos += count;
+	}
+	return done;
+}
+
+s32_t spiffs_lite_lseek(spiffs_lite *lfs, spiffs_file fh, s32_t offs, int whence) {
+	spiffs_lite_fd *fd = get_fd(lfs, fh);
+	if (fd == NULL) return lfs->err;
+	if (whence == SPIFFS_SEEK_CUR) offs += fd->pos;
+	else if (whence == SPIFFS_SEEK_END) offs += fd->size;
+	if (offs < 0 || (u32_t)offs > fd->size) return (lfs->err = SPIFFS_ERR_END_OF_OBJECT);
+	fd->pos = offs;
+	return offs;
+}
+
+s32_t spiffs_lite_tell(spiffs_lite *lfs, spiffs_file fh) {
+	spiffs_lite_fd *fd = get_fd(lfs, fh);
+	if (fd == NULL) return lfs->err;
+	return fd->pos;
+}
+
+s32_t spiffs_lite_close(spiffs_lite *lfs, spiffs_file fh) {
+	spiffs_lite_fd *fd = get_fd(lfs, fh);
+	if (fd == NULL) return lfs->err;
+	fd->obj_id = 0;
+	return SPIFFS_OK;
+}
+
+s32_t spiffs_lite_errno(spiffs_lite *lfs) {
+	return lfs->err;
+}
+
+s32_t spiffs_lite_map(spiffs_lite *lfs, spiffs_file fh, spiffs_page_ix *map, u32_t entries) {
+	spiffs *fs = &lfs->fs;
+	spiffs_lite_fd *fd = get_fd(lfs, fh);
+	spiffs_block_ix block = 0;
+	int entry = 0;
+	ix_key key;
+	u32_t loop;
+	if (fd == NULL) return lfs->err;
+	fd->map_entries = 0;
+	entries = MIN(entries, (fd->size + SPIFFS_DATA_PAGE_SIZE(fs) - 1) / SPIFFS_DATA_PAGE_SIZE(fs));
+	if (entries == 0) return 0;
+	// entries the index pages don't fill in are read as normal
+	memset(map, 0xff, entries * sizeof(spiffs_page_ix));
+	// from the header
+	if (fd->ix_spix != 0) {
+		fd->ix_spix = (spiffs_span_ix)-1;
+		if (hal_read(lfs, SPIFFS_PAGE_TO_PADDR(fs, fd->hdr_pix), SPIFFS_CFG_LOG_PAGE_SZ(fs), fd->ix_page) < SPIFFS_OK) return lfs->err;
+		fd->ix_spix = 0;
+	}
+	for (loop = 0; loop < MIN(entries, SPIFFS_OBJ_HDR_IX_LEN(fs)); loop++) {
+		map[loop] = ((spiffs_page_ix*)(fd->ix_page + sizeof(spiffs_page_object_ix_header)))[loop];
+	}
+	// then the other index pages, found in one pass, in whatever order
+	key.obj_id = fd->obj_id;
+	key.span_ix = SPIFFS_OBJ_IX_ENTRY_SPAN_IX(fs, entries - 1);
+	for (loop = 0; loop < key.span_ix; loop++) {
+		spiffs_page_object_ix *ix = (spiffs_page_object_ix*)fd->ix_page;
+		u32_t first, count;
+		s32_t pix = lu_find(lfs, &block, &entry, check_ix_any, &key);
+		if (pix < 0) break;
+		fd->ix_spix = (spiffs_span_ix)-1;
+		if (hal_read(lfs, SPIFFS_PAGE_TO_PADDR(fs, pix), SPIFFS_CFG_LOG_PAGE_SZ(fs), fd->ix_page) < SPIFFS_OK) return lfs->err;
+		fd->ix_spix = ix->p_hdr.span_ix;
+		first = SPIFFS_OBJ_HDR_IX_LEN(fs) + (ix->p_hdr.span_ix - 1) * SPIFFS_OBJ_IX_LEN(fs);
+		count = MIN(entries - first, SPIFFS_OBJ_IX_LEN(fs));
+		memcpy(&map[first], fd->ix_page + sizeof(spiffs_page_object_ix), count * sizeof(spiffs_page_ix));
+	}
+	fd->map = map;
+	fd->map_entries = entries;
+	return entries;
+}
+
+void spiffs_lite_opendir(spiffs_lite *lfs, spiffs_lite_dir *d) {
+	d->lfs = lfs;
+	d->block = 0;
+	d->entry = 0;
+}
+
+struct spiffs_dirent *spiffs_lite_readdir(spiffs_lite_dir *d, struct spiffs_dirent *e) {
+	spiffs_page_object_ix_header hdr __attribute__ ((aligned (4)));
+	s32_t pix = lu_find(d->lfs, &d->block, &d->entry, check_name, NULL);
+	if (pix < 0) return NULL;
+	if (hal_read(d->lfs, SPIFFS_PAGE_TO_PADDR(&d->lfs->fs, pix), sizeof(hdr), &hdr) < SPIFFS_OK) return NULL;
+	e->obj_id = hdr.p_hdr.obj_id & ~SPIFFS_OBJ_ID_IX_FLAG;
+	memcpy(e->name, hdr.name, SPIFFS_OBJ_NAME_LEN);
+	e->type = hdr.type;
+	e->size = (hdr.size == SPIFFS_UNDEFINED_LEN ? 0 : hdr.size);
+	e->pix = pix;
+	return e;
+}
@@ -0,0 +1,93 @@
+//////////////////////////////////////////////////
+// Read only spiffs access for sBoot.
+// Copyright 2015-2019 Richard A Burton
+// richardaburton@gmail.com
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+#ifndef SPIFFS_LITE_H
+#define SPIFFS_LITE_H
+
+// reads a spiffs filesystem straight from flash, using the spiffs on flash
+// format, for a boot loader that only needs to read a file or two
+// mounting only checks the config and the magic of the first block, there
+// is no scan of the filesystem, and a file is found by name with a single
+// pass over the object lookup pages that stops at the first match, so the
+// time taken depends on where the file is, not the size of the filesystem
+// uses the spiffs types, error codes and seek constants, the config needs
+// SPIFFS_USE_MAGIC
+
+#include <spiffs.h>
+
+// number of files that can be open at once
+#ifndef SPIFFS_LITE_FILES
+#define SPIFFS_LITE_FILES 2
+#endif
+
+// largest logical page size supported
+#ifndef SPIFFS_LITE_PAGE_SIZE
+#define SPIFFS_LITE_PAGE_SIZE 256
+#endif
+
+typedef struct {
+	// object id of the file (without the index flag), 0 if not open
+	spiffs_obj_id obj_id;
+	u32_t size;
+	u32_t pos;
+	// page of its object index header
+	spiffs_page_ix hdr_pix;
+	// the object index page last used, and its span index
+	spiffs_span_ix ix_spix;
+	u8_t ix_page[SPIFFS_LITE_PAGE_SIZE] __attribute__ ((aligned (4)));
+	// optional map of the data pages (see spiffs_lite_map)
+	spiffs_page_ix *map;
+	u32_t map_entries;
+} spiffs_lite_fd;
+
+typedef struct {
+	// the library's state, only the config and block count are used, so
+	// the spiffs_nucleus.h macros can be used as they are
+	spiffs fs;
+	// last error
+	s32_t err;
+	spiffs_lite_fd fds[SPIFFS_LITE_FILES];
+	// the data page last read, and its page index
+	u8_t page[SPIFFS_LITE_PAGE_SIZE] __attribute__ ((aligned (4)));
+	spiffs_page_ix page_pix;
+} spiffs_lite;
+
+// position of a directory listing
+typedef struct {
+	spiffs_lite *lfs;
+	spiffs_block_ix block;
+	int entry;
+} spiffs_lite_dir;
+
+// the config needs the physical address and size, block and page sizes
+// and the read function, nothing is written
+s32_t spiffs_lite_mount(spiffs_lite *lfs, spiffs_config *cfg);
+
+// file access, much as the spiffs functions, read only
+spiffs_file spiffs_lite_open(spiffs_lite *lfs, const char *path);
+s32_t spiffs_lite_read(spiffs_lite *lfs, spiffs_file fh, void *buf, s32_t len);
+s32_t spiffs_lite_lseek(spiffs_lite *lfs, spiffs_file fh, s32_t offs, int whence);
+s32_t spiffs_lite_tell(spiffs_lite *lfs, spiffs_file fh);
+s32_t spiffs_lite_close(spiffs_lite *lfs, spiffs_file fh);
+s32_t spiffs_lite_errno(spiffs_lite *lfs);
+
+// resolve the page index of each data page of the file up front, into
+// map, from one pass over the object lookup pages, rather than finding
+// each object index page as it is needed, entries is the size of map,
+// any of the file past that is read as normal
+// once mapped, reads of at least two pages that are next to each other
+// in flash are made in one go, straight into the buffer (if it is word
+// aligned), with the page headers then taken out
+// returns the number of pages mapped, the map must stay valid until
+// the file is closed
+s32_t spiffs_lite_map(spiffs_lite *lfs, spiffs_file fh, spiffs_page_ix *map, u32_t entries);
+
+// list the files, this does scan the whole filesystem
+void spiffs_lite_opendir(spiffs_lite *lfs, spiffs_lite_dir *d);
+struct spiffs_dirent *spiffs_lite_readdir(spiffs_lite_dir *d, struct spiffs_dirent *e);
+
+#endif
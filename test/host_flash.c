@@ -0,0 +1,182 @@
+//////////////////////////////////////////////////
+// sBoot open source boot loader for ESP8266.
+// Copyright 2015-2019 Richard A Burton
+// richardaburton@gmail.com
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sboot-private.h>
+#include "host_flash.h"
+
+// winbond 4MB, supports the 32k block erase
+#define DEFAULT_ID 0x1640ef
+
+uint8_t host_flash[HOST_FLASH_SIZE];
+uint32_t host_flash_erased[HOST_FLASH_SIZE / SECTOR_SIZE];
+uint32_t host_flash_id = DEFAULT_ID;
+host_flash_stats host_flash_counts;
+
+// typical times from flash datasheets, and a host roughly a few hundred
+// times faster at inflating than the esp8266 at 80MHz
+host_flash_timing host_flash_times = {
+	45000, 120000, 150000, 200, 400
+};
+
+// controller registers, from SPI_CMD to the last data register
+uint32_t host_spi_regs[0x80 / 4];
+
+// the rom functions take a pointer to this, it isn't used
+void *flashchip;
+
+// host time the current erase or program finishes
+static double busy_until;
+// write enable latch, set by SPI_write_enable, cleared by each erase
+// or program, as on the chip
+static uint32_t write_enabled;
+
+static double now_us(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+static void error(const char *fmt, ...) {
+	va_list args;
+	printf("host flash: ");
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	printf("\n");
+	host_flash_counts.errors++;
+}
+
+// true if the last erase or program hasn't finished, anything sent to the
+// chip now would be ignored, so it is an error for sBoot to do that
+static uint32_t busy(const char *what, uint32_t addr) {
+	if (now_us() < busy_until) {
+		error("%s at 0x%06x while busy", what, addr);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static void start_busy(uint32_t us) {
+	host_flash_counts.busy_us += us;
+	busy_until = now_us() + (double)us / host_flash_times.speedup;
+}
+
+void host_flash_reset(void) {
+	busy_until = 0;
+	write_enabled = FALSE;
+	memset(&host_flash_counts, 0, sizeof(host_flash_counts));
+	memset(host_flash_erased, 0, sizeof(host_flash_erased));
+}
+
+static void erase(uint32_t addr, uint32_t size, uint32_t us) {
+	if (busy("erase", addr)) return;
+	if (!write_enabled) error("erase at 0x%06x without write enable", addr);
+	else if (addr % size || addr + size > HOST_FLASH_SIZE) error("erase of 0x%x at 0x%06x", size, addr);
+	else {
+		uint32_t loop;
+		memset(host_flash + addr, 0xff, size);
+		for (loop = 0; loop < size; loop += SECTOR_SIZE) host_flash_erased[(addr + loop) / SECTOR_SIZE]++;
+		host_flash_counts.erases++;
+		start_busy(us);
+	}
+	write_enabled = FALSE;
+}
+
+static void program(uint32_t addr, uint32_t len) {
+	const uint8_t *data = (const uint8_t*)&SPI_W0;
+	uint32_t loop;
+	if (busy("program", addr)) return;
+	if (!write_enabled) error("program at 0x%06x without write enable", addr);
+	else if (len == 0 || len > PROGRAM_CHUNK || (addr % PAGE_SIZE) + len > PAGE_SIZE || addr + len > HOST_FLASH_SIZE) {
+		error("program of %d bytes at 0x%06x", len, addr);
+	} else {
+		for (loop = 0; loop < len; loop++) {
+			// programming can only clear bits
+			if ((host_flash[addr + loop] & data[loop]) != data[loop]) {
+				error("program at 0x%06x, not erased", addr + loop);
+				break;
+			}
+			host_flash[addr + loop] &= data[loop];
+		}
+		host_flash_counts.programs++;
+		start_busy(host_flash_times.program);
+	}
+	write_enabled = FALSE;
+}
+
+// SPI_CMD, carrying out the command last written to it
+volatile uint32_t *host_spi_cmd(void) {
+	uint32_t cmd = host_spi_regs[0];
+	host_spi_regs[0] = 0;
+	if (cmd == SPI_CMD_RDID) {
+		if (!busy("read id", 0)) SPI_W0 = host_flash_id;
+	} else if (cmd == SPI_CMD_SE) {
+		erase(SPI_ADDR & 0xffffff, SECTOR_SIZE, host_flash_times.erase_sector);
+	} else if (cmd == SPI_CMD_BE) {
+		erase(SPI_ADDR & 0xffffff, BLOCK64_SIZE, host_flash_times.erase_64k);
+	} else if (cmd == SPI_CMD_USR && (SPI_USER2 & 0xff) == FLASH_CMD_ERASE32) {
+		erase(SPI_ADDR >> 8, BLOCK32_SIZE, host_flash_times.erase_32k);
+	} else if (cmd == SPI_CMD_PP) {
+		program(SPI_ADDR & 0xffffff, SPI_ADDR >> 24);
+	} else if (cmd != 0) {
+		error("unknown command 0x%08x", cmd);
+	}
+	return &host_spi_regs[0];
+}
+
+// esp8266 built in rom functions
+
+uint32_t Wait_SPI_Idle(void *chip) {
+	double now = now_us();
+	if (now < busy_until) {
+		host_flash_counts.waited_us += (busy_until - now) * host_flash_times.speedup;
+		while (now_us() < busy_until);
+	}
+	return 0;
+}
+
+uint32_t SPI_write_enable(void *chip) {
+	if (!busy("write enable", 0)) write_enabled = TRUE;
+	return 0;
+}
+
+uint32_t SPIRead(uint32_t addr, void *outptr, uint32_t len) {
+	if (busy("read", addr)) return 1;
+	if (addr + len > HOST_FLASH_SIZE) {
+		error("read of %d bytes at 0x%06x", len, addr);
+		return 1;
+	}
+	memcpy(outptr, host_flash + addr, len);
+	host_flash_counts.reads++;
+	return 0;
+}
+
+void ets_printf(const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+}
+
+void ets_delay_us(int us) {
+}
+
+void ets_memset(void *dst, uint8_t val, uint32_t len) {
+	memset(dst, val, len);
+}
+
+void ets_memcpy(void *dst, const void *src, uint32_t len) {
+	memcpy(dst, src, len);
+}
+
+int ets_memcmp(const void *a, const void *b, uint32_t len) {
+	return memcmp(a, b, len);
+}
@@ -0,0 +1,58 @@
+#ifndef __HOST_FLASH_H__
+#define __HOST_FLASH_H__
+
+//////////////////////////////////////////////////
+// sBoot open source boot loader for ESP8266.
+// Copyright 2015-2019 Richard A Burton
+// richardaburton@gmail.com
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// host stand-in for the spi flash and its controller, for the host test
+// build of sBoot (BOOT_HOST_TEST), sBoot's own flash code runs as it is,
+// writing the controller registers, the stand-in carries out each command
+// and keeps the flash busy for as long as a real chip would, scaled down
+// by speedup, so any access sBoot makes before waiting is caught, as is a
+// program of bits that haven't been erased, and the time spent waiting
+// can be compared with the time the flash was busy
+
+#include <stdint.h>
+
+// size of the simulated flash
+#define HOST_FLASH_SIZE 0x400000
+
+// busy times, in microseconds on the real chip
+typedef struct {
+	uint32_t erase_sector;
+	uint32_t erase_32k;
+	uint32_t erase_64k;
+	// each program command, of up to 64 bytes
+	uint32_t program;
+	// how much faster the host decompresses than the esp8266, the busy
+	// times are divided by this, so they are in proportion
+	uint32_t speedup;
+} host_flash_timing;
+
+// counts since the last host_flash_reset, times in microseconds on the
+// real chip (so the host's times multiplied by speedup)
+typedef struct {
+	uint32_t erases;
+	uint32_t programs;
+	uint32_t reads;
+	uint32_t errors;
+	double busy_us;
+	double waited_us;
+} host_flash_stats;
+
+extern uint8_t host_flash[HOST_FLASH_SIZE];
+// times each sector has been erased
+extern uint32_t host_flash_erased[HOST_FLASH_SIZE / 0x1000];
+extern host_flash_timing host_flash_times;
+extern host_flash_stats host_flash_counts;
+// jedec id returned, manufacturer in the low byte
+extern uint32_t host_flash_id;
+
+// clear the counts, and finish anything still running
+void host_flash_reset(void);
+
+#endif
@@ -0,0 +1,430 @@
+//////////////////////////////////////////////////
+// sBoot open source boot loader for ESP8266.
+// Copyright 2015-2019 Richard A Burton
+// richardaburton@gmail.com
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// installs updates on the host, with sBoot's own code (built with
+// BOOT_HOST_TEST) driving the flash stand-in in host_flash.c, checks each
+// is installed, that sBoot never sends the flash anything while it is
+// still busy, or programs bits that aren't erased, and shows how much of
+// the time the flash was busy sBoot was decompressing, rather than
+// waiting for it
+//
+// usage: install_test [speedup [sector 32k 64k program]]
+//        busy times in microseconds on the real chip
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "sboot.c"
+#include "host_flash.h"
+
+#define ROM_SIZE  0x40000
+#define DATA_SIZE 0x10000
+// data target for the manifest test, clear of everything sBoot uses
+#define DATA_TARGET 0x300000
+
+////////////////////////////////////////////////////////////////
+/// Files in spiffs, stored one after another in the spiffs area of
+/// the flash, and read through sBoot's own spiffs read function, so
+/// each read waits for the flash as it would on the chip.
+///
+
+#define MAX_FILES 4
+
+typedef struct {
+	char name[SPIFFS_OBJ_NAME_LEN];
+	uint32_t addr;
+	uint32_t len;
+	uint32_t pos;
+} test_file;
+
+static test_file files[MAX_FILES];
+static uint32_t file_count;
+static s32_t file_err;
+
+static void clear_files(void) {
+	memset(host_flash + BOOT_SPIFFS_OFFSET, 0xff, BOOT_SPIFFS_SIZE);
+	file_count = 0;
+}
+
+static void add_file(const char *name, const uint8_t *data, uint32_t len) {
+	uint32_t addr = BOOT_SPIFFS_OFFSET;
+	if (file_count > 0) addr = files[file_count - 1].addr + files[file_count - 1].len;
+	if (file_count == MAX_FILES || addr + len > BOOT_SPIFFS_OFFSET + BOOT_SPIFFS_SIZE) {
+		printf("No room for %s in spiffs.\n", name);
+		exit(EXIT_FAILURE);
+	}
+	strncpy(files[file_count].name, name, SPIFFS_OBJ_NAME_LEN - 1);
+	files[file_count].addr = addr;
+	files[file_count].len = len;
+	memcpy(host_flash + addr, data, len);
+	file_count++;
+}
+
+static test_file *get_file(spiffs_file fh) {
+	if (fh < 1 || fh > file_count) {
+		file_err = SPIFFS_ERR_BAD_DESCRIPTOR;
+		return NULL;
+	}
+	return &files[fh - 1];
+}
+
+static spiffs_file file_open(const char *name) {
+	uint32_t loop;
+	for (loop = 0; loop < file_count; loop++) {
+		if (strcmp(files[loop].name, name) == 0) {
+			files[loop].pos = 0;
+			return loop + 1;
+		}
+	}
+	return (file_err = SPIFFS_ERR_NOT_FOUND);
+}
+
+static s32_t file_read(spiffs_file fh, void *buf, s32_t len) {
+	test_file *f = get_file(fh);
+	if (f == NULL) return file_err;
+	if (f->pos >= f->len) return (file_err = SPIFFS_ERR_END_OF_OBJECT);
+	len = MIN((uint32_t)len, f->len - f->pos);
+	my_spi_read(f->addr + f->pos, len, buf);
+	f->pos += len;
+	return len;
+}
+
+static s32_t file_lseek(spiffs_file fh, s32_t offs, int whence) {
+	test_file *f = get_file(fh);
+	if (f == NULL) return file_err;
+	if (whence == SPIFFS_SEEK_CUR) offs += f->pos;
+	else if (whence == SPIFFS_SEEK_END) offs += f->len;
+	if (offs < 0 || (uint32_t)offs > f->len) return (file_err = SPIFFS_ERR_END_OF_OBJECT);
+	f->pos = offs;
+	return offs;
+}
+
+static s32_t file_tell(spiffs_file fh) {
+	test_file *f = get_file(fh);
+	if (f == NULL) return file_err;
+	return f->pos;
+}
+
+static struct spiffs_dirent *file_readdir(int *entry, struct spiffs_dirent *e) {
+	if (*entry >= file_count) return NULL;
+	memset(e, 0, sizeof(*e));
+	strcpy((char*)e->name, files[*entry].name);
+	e->size = files[*entry].len;
+	e->obj_id = ++*entry;
+	return e;
+}
+
+// spiffs api, as sBoot is built to use it
+
+#ifdef BOOT_SPIFFS_LITE
+s32_t spiffs_lite_mount(spiffs_lite *lfs, spiffs_config *cfg) {
+	return SPIFFS_OK;
+}
+
+spiffs_file spiffs_lite_open(spiffs_lite *lfs, const char *path) {
+	return file_open(path);
+}
+
+s32_t spiffs_lite_read(spiffs_lite *lfs, spiffs_file fh, void *buf, s32_t len) {
+	return file_read(fh, buf, len);
+}
+
+s32_t spiffs_lite_lseek(spiffs_lite *lfs, spiffs_file fh, s32_t offs, int whence) {
+	return file_lseek(fh, offs, whence);
+}
+
+s32_t spiffs_lite_tell(spiffs_lite *lfs, spiffs_file fh) {
+	return file_tell(fh);
+}
+
+s32_t spiffs_lite_close(spiffs_lite *lfs, spiffs_file fh) {
+	return SPIFFS_OK;
+}
+
+s32_t spiffs_lite_errno(spiffs_lite *lfs) {
+	return file_err;
+}
+
+s32_t spiffs_lite_map(spiffs_lite *lfs, spiffs_file fh, spiffs_page_ix *map, u32_t entries) {
+	return 0;
+}
+
+void spiffs_lite_opendir(spiffs_lite *lfs, spiffs_lite_dir *d) {
+	d->entry = 0;
+}
+
+struct spiffs_dirent *spiffs_lite_readdir(spiffs_lite_dir *d, struct spiffs_dirent *e) {
+	return file_readdir(&d->entry, e);
+}
+#else
+s32_t SPIFFS_mount(spiffs *fs, spiffs_config *config, u8_t *work,
+	u8_t *fd_space, u32_t fd_space_size, void *cache, u32_t cache_size,
+	spiffs_check_callback check_cb_f) {
+	return SPIFFS_OK;
+}
+
+void SPIFFS_unmount(spiffs *fs) {
+}
+
+spiffs_file SPIFFS_open(spiffs *fs, const char *path, spiffs_flags flags, spiffs_mode mode) {
+	return file_open(path);
+}
+
+s32_t SPIFFS_read(spiffs *fs, spiffs_file fh, void *buf, s32_t len) {
+	return file_read(fh, buf, len);
+}
+
+s32_t SPIFFS_lseek(spiffs *fs, spiffs_file fh, s32_t offs, int whence) {
+	return file_lseek(fh, offs, whence);
+}
+
+s32_t SPIFFS_tell(spiffs *fs, spiffs_file fh) {
+	return file_tell(fh);
+}
+
+s32_t SPIFFS_close(spiffs *fs, spiffs_file fh) {
+	return SPIFFS_OK;
+}
+
+s32_t SPIFFS_errno(spiffs *fs) {
+	return file_err;
+}
+
+spiffs_DIR *SPIFFS_opendir(spiffs *fs, const char *name, spiffs_DIR *d) {
+	d->entry = 0;
+	return d;
+}
+
+struct spiffs_dirent *SPIFFS_readdir(spiffs_DIR *d, struct spiffs_dirent *e) {
+	return file_readdir(&d->entry, e);
+}
+
+s32_t SPIFFS_closedir(spiffs_DIR *d) {
+	return SPIFFS_OK;
+}
+#endif
+
+////////////////////////////////////////////////////////////////
+/// Test data and ota files.
+///
+
+static uint32_t seed;
+
+static uint32_t random32(void) {
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+// mostly short copies of what came shortly before, like code, so it
+// compresses to around half, as a rom does
+static void make_data(uint8_t *data, uint32_t len, uint32_t start) {
+	uint32_t pos = 0;
+	seed = start;
+	while (pos < len) {
+		uint32_t run = 4 + random32() % 24;
+		uint32_t from = random32() % 0x1000 + 1;
+		uint32_t loop;
+		if (pos >= from && random32() % 3) {
+			for (loop = 0; loop < run && pos < len; loop++, pos++) data[pos] = data[pos - from];
+		} else {
+			for (loop = 0; loop < run / 4 && pos < len; loop++, pos++) data[pos] = random32();
+		}
+	}
+}
+
+static void add_le32(uint8_t *out, uint32_t val) {
+	out[0] = val;
+	out[1] = val >> 8;
+	out[2] = val >> 16;
+	out[3] = val >> 24;
+}
+
+// gzip compress data into out, with the window sBoot is built with,
+// declaring window_bits (in a 'sw' extra field) if it isn't 0, returns
+// the length
+static uint32_t make_gzip(uint8_t *out, uint32_t size, const uint8_t *data, uint32_t len, int window_bits) {
+	z_stream strm;
+	uint32_t pos = 10;
+	memset(out, 0, 10);
+	out[0] = 0x1f;
+	out[1] = 0x8b;
+	out[2] = Z_DEFLATED;
+	out[9] = 3;
+	if (window_bits) {
+		out[3] = 0x04; // FEXTRA
+		out[pos++] = 5;
+		out[pos++] = 0;
+		out[pos++] = 's';
+		out[pos++] = 'w';
+		out[pos++] = 1;
+		out[pos++] = 0;
+		out[pos++] = window_bits;
+	}
+	memset(&strm, 0, sizeof(strm));
+	deflateInit2(&strm, 9, Z_DEFLATED, -UZLIB_WINDOW_BITS, 9, Z_DEFAULT_STRATEGY);
+	strm.next_in = (uint8_t*)data;
+	strm.avail_in = len;
+	strm.next_out = out + pos;
+	strm.avail_out = size - pos - 8;
+	if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+		printf("Compressed data too big.\n");
+		exit(EXIT_FAILURE);
+	}
+	pos += strm.total_out;
+	deflateEnd(&strm);
+	add_le32(out + pos, crc32(0, data, len));
+	add_le32(out + pos + 4, len);
+	return pos + 8;
+}
+
+////////////////////////////////////////////////////////////////
+/// Tests, each runs sBoot's update check, with the files in spiffs.
+///
+
+static uint8_t rom1[ROM_SIZE];
+static uint8_t rom2[ROM_SIZE];
+static uint8_t data[DATA_SIZE];
+static uint8_t file[BOOT_SPIFFS_SIZE];
+static uint32_t failures;
+
+static void check(uint32_t ok, const char *what) {
+	if (!ok) {
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+// run the update check, as sBoot does on boot with the update flag set
+static void run_sboot(partition_info *parts, boot_config *config) {
+	host_flash_reset();
+	read_config(parts, config);
+	check_updates(parts, config);
+	flash_wait();
+	check(host_flash_counts.errors == 0, "flash accessed while busy, or programmed unerased");
+}
+
+// show how much of the time the flash was busy sBoot carried on working
+static void show_overlap(const char *what) {
+	host_flash_stats *c = &host_flash_counts;
+	printf("%s: %d erases, %d programs, flash busy %.0fms, waited %.0fms, %.0f%% overlapped.\n",
+		what, c->erases, c->programs, c->busy_us / 1000, c->waited_us / 1000,
+		c->busy_us > 0 ? 100 * (c->busy_us - c->waited_us) / c->busy_us : 0);
+}
+
+static uint32_t erased(uint32_t addr, uint32_t len) {
+	uint32_t count = 0;
+	uint32_t loop;
+	for (loop = addr; loop < addr + len; loop += SECTOR_SIZE) count += host_flash_erased[loop / SECTOR_SIZE];
+	return count;
+}
+
+// install a rom into a slot holding something else, and then another
+// into the other slot
+static void test_rom(partition_info *parts, boot_config *config) {
+	uint32_t len;
+	clear_files();
+	len = make_gzip(file, sizeof(file), rom1, ROM_SIZE, 0);
+	add_file(BOOT_OTA_FILE, file, len);
+	run_sboot(parts, config);
+	check(memcmp(host_flash + BOOT_SLOT_B_OFFSET, rom1, ROM_SIZE) == 0, "rom installed to slot b");
+	check(config->slot == 1, "slot b booted");
+	show_overlap("gzip rom");
+
+	clear_files();
+	len = make_gzip(file, sizeof(file), rom2, ROM_SIZE, 0);
+	add_file(BOOT_OTA_FILE, file, len);
+	run_sboot(parts, config);
+	check(memcmp(host_flash + BOOT_SLOT_A_OFFSET, rom2, ROM_SIZE) == 0, "rom installed to slot a");
+	check(config->slot == 0, "slot a booted");
+	show_overlap("gzip rom");
+}
+
+// a rom needing a bigger window than sBoot has is rejected before
+// anything is erased
+static void test_window(partition_info *parts, boot_config *config) {
+#ifndef BOOT_FLASH_WINDOW
+	uint32_t len;
+	clear_files();
+	len = make_gzip(file, sizeof(file), rom1 + 1, ROM_SIZE - 1, UZLIB_WINDOW_BITS + 1);
+	add_file(BOOT_OTA_FILE, file, len);
+	run_sboot(parts, config);
+	check(config->slot == 0, "slot a still booted");
+	check(erased(BOOT_SLOT_B_OFFSET, BOOT_SLOT_SIZE) == 0, "slot b not erased");
+	check(memcmp(host_flash + BOOT_SLOT_B_OFFSET, rom1, ROM_SIZE) == 0, "slot b unchanged");
+#endif
+}
+
+// data written in place, from a manifest, only the sectors that have
+// changed are erased
+static void test_data(partition_info *parts, boot_config *config) {
+	uint8_t entry[MANIFEST_HEADER_SIZE + MANIFEST_ENTRY_SIZE];
+	uint32_t len;
+	memcpy(host_flash + DATA_TARGET, data, DATA_SIZE);
+	data[0x2100]++;
+	data[0x9ffe]++;
+	clear_files();
+	memset(entry, 0, sizeof(entry));
+	add_le32(entry, MANIFEST_MAGIC);
+	add_le32(entry + 4, 1);
+	add_le32(entry + 8, DATA_TARGET);
+	add_le32(entry + 12, DATA_SIZE);
+	add_le32(entry + 16, crc32(0, data, DATA_SIZE));
+	strcpy((char*)entry + 20, "data.gz");
+	add_file(BOOT_MANIFEST_FILE, entry, sizeof(entry));
+	len = make_gzip(file, sizeof(file), data, DATA_SIZE, 0);
+	add_file("data.gz", file, len);
+	run_sboot(parts, config);
+	check(memcmp(host_flash + DATA_TARGET, data, DATA_SIZE) == 0, "data installed");
+	check(erased(DATA_TARGET, DATA_SIZE) == 2, "only changed sectors erased");
+	show_overlap("in place data");
+}
+
+int main(int argc, char **argv) {
+	partition_info parts;
+	boot_config config;
+	uint32_t loop;
+
+	if (argc > 1) host_flash_times.speedup = atoi(argv[1]);
+	if (argc > 5) {
+		host_flash_times.erase_sector = atoi(argv[2]);
+		host_flash_times.erase_32k = atoi(argv[3]);
+		host_flash_times.erase_64k = atoi(argv[4]);
+		host_flash_times.program = atoi(argv[5]);
+	}
+	if (host_flash_times.speedup == 0) {
+		printf("Usage: %s [speedup [sector 32k 64k program]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// a used flash, with no boot config yet
+	make_data(host_flash, HOST_FLASH_SIZE, 1);
+	get_partitions(&parts);
+	for (loop = 0; loop < BOOT_CONFIG_COPIES; loop++) {
+		memset(host_flash + parts.config_offset[loop], 0xff, SECTOR_SIZE);
+	}
+	memset(host_flash + parts.journal_offset, 0xff, SECTOR_SIZE);
+
+	// the second rom is the first with a few changes, and some code
+	// inserted part way, moving the rest
+	make_data(rom1, ROM_SIZE, 2);
+	memcpy(rom2, rom1, ROM_SIZE);
+	for (loop = 0; loop < ROM_SIZE; loop += 0x3000) rom2[loop]++;
+	memmove(rom2 + 0x20100, rom2 + 0x20000, ROM_SIZE - 0x20100);
+	make_data(data, DATA_SIZE, 3);
+
+	test_rom(&parts, &config);
+	test_window(&parts, &config);
+	test_data(&parts, &config);
+
+	if (failures) {
+		printf("%d checks failed.\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("All checks passed.\n");
+	return EXIT_SUCCESS;
+}
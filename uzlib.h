@@ -30,12 +30,186 @@
 #define UZLIB_FNAME    8
 #define UZLIB_FCOMMENT 16
 
+// Zlib header preset dictionary flag
+#define UZLIB_FDICT    32
+
+// size of the decompression window, as a power of 2, the deflate maximum
+// is 15 (32k), smaller windows save ram but streams with back references
+// further than the window will be rejected with UZLIB_DICT_ERROR
+// override on the compiler command line to change
+#ifndef UZLIB_WINDOW_BITS
+#define UZLIB_WINDOW_BITS 15
+#endif
+
+// optional gzip extra field subfield declaring the window size used to
+// compress the stream (one byte, window bits), if present streams that
+// need a bigger window are rejected when the header is read, before
+// any output is produced
+#define UZLIB_XWINDOW_SI1 's'
+#define UZLIB_XWINDOW_SI2 'w'
+
+// size of the cache used for back references older than the window when
+// a history callback is set (see uzlib_inflate_set_history), must be a
+// power of 2, reads from the callback are aligned to this size
+#ifndef UZLIB_HISTORY_CACHE
+#define UZLIB_HISTORY_CACHE 256
+#endif
+
+// largest back reference distance deflate can produce
+#define UZLIB_MAX_DIST 32768
+
+// number of bits resolved by the first level huffman lookup table
+#define UZLIB_FAST_BITS 9
+
+typedef struct {
+   uint16_t fast[1 << UZLIB_FAST_BITS]; /* first level lookup table */
+   uint16_t table[16];  /* table of code length counts */
+   uint16_t trans[288]; /* code -> symbol translation table */
+} UZLIB_TREE;
+
+// decompression state, owned by the caller, includes the
+// window so should be static rather than on the stack
+typedef struct {
+	// word aligned for the crc32
+	uint8_t decomp_buffer[1 << UZLIB_WINDOW_BITS] __attribute__ ((aligned (4)));
+	uint32_t decomp_pos;
+
+	uint8_t *source;
+	uint32_t source_len;
+	uint32_t source_pos;
+ /*
+  * extra bits and base tables for length and distance codes
+  */
+  uint8_t  lengthBits[30];
+  uint16_t lengthBase[30];
+  uint8_t  distBits[30];
+  uint16_t distBase[30];
+ /*
+  * special ordering of code length codes
+  */
+  uint8_t  clcidx[19];
+ /*
+  * dynamic length/symbol and distance trees
+  */
+  UZLIB_TREE ltree;
+  UZLIB_TREE dtree;
+ /*
+  * methods encapsulate handling of the input and output streams
+  */
+  void (*put_bytes)(void*, uint8_t*, uint32_t);
+  uint32_t (*get_bytes)(void*);
+  // user data passed to callbacks
+  void *cb_data;
+  // optional, reads back output older than the window (see below)
+  void (*get_history)(void*, uint32_t, uint8_t*, uint32_t);
+  // cache of output read back through get_history, and the output
+  // position of its first byte
+  uint8_t hist_cache[UZLIB_HISTORY_CACHE] __attribute__ ((aligned (4)));
+  uint32_t hist_pos;
+ /*
+  * Other state values
+  */
+  uint32_t tag;
+  uint32_t bitcount;
+  uint32_t lzOffs;
+  int32_t  bType;
+  int32_t  bFinal;
+  uint32_t curLen;
+  uint32_t dest_len;
+  uint32_t checksum;
+  uint8_t  header_done;
+  uint8_t  input_end;
+  // zlib rather than gzip stream
+  uint8_t  zlib;
+  // preset dictionary length and adler32
+  uint32_t dict_len;
+  uint32_t dict_adler;
+  // output in the buffer before flush_pos is the dictionary, or has
+  // already been passed to put_bytes at a sync point
+  uint32_t flush_pos;
+} UZLIB_DATA;
+
+// step-wise api, with caller owned state
+void uzlib_inflate_init (UZLIB_DATA *d, uint32_t (*)(void *), void (*)(void *, uint8_t *, uint32_t), void *cb_data, uint8_t *);
+int32_t uzlib_inflate_step (UZLIB_DATA *d, uint32_t budget);
+int32_t uzlib_inflate_finish (UZLIB_DATA *d);
+
+// decode another stream that follows the current one in the input, call
+// after uzlib_inflate_finish, keeps any input already read
+void uzlib_inflate_next (UZLIB_DATA *d);
+
+// set a preset dictionary for a zlib stream (checked against its dictid),
+// call before the first step, can be called repeatedly to add the
+// dictionary in parts, the dictionary counts as earlier output, so a
+// history callback can't also be used
+void uzlib_inflate_set_dict (UZLIB_DATA *d, const uint8_t *dict, uint32_t len);
+
+// set a callback to read back output that has already been passed to
+// put_bytes, call after uzlib_inflate_init, the callback is passed
+// cb_data, the offset of the data in the output stream, a buffer and a
+// length to read, with the offset and length both aligned to (and the
+// same as) UZLIB_HISTORY_CACHE, bytes past the end of the output so far
+// are never used
+// back references further than the window are then served from the
+// callback, through a small cache, rather than being rejected, so a
+// small window can be used to decompress any stream
+void uzlib_inflate_set_history (UZLIB_DATA *d, void (*)(void *, uint32_t, uint8_t *, uint32_t));
+
+// decoder state at a sync point, between deflate blocks with all the
+// output so far passed to put_bytes, enough to carry on decoding later
+// from the input that follows, with the window read back from the output
+typedef struct {
+  uint32_t tag;
+  uint32_t bitcount;
+  uint32_t dest_len;
+  uint32_t decomp_pos;
+  uint32_t checksum;
+  uint32_t zlib;
+} UZLIB_SYNC;
+
+// if the decoder is at a sync point (steps end at each deflate block
+// boundary) pass any output still in the window to put_bytes and save
+// the state, returns the number of bytes of input read through
+// get_bytes but not yet used, or -1 if it isn't at a sync point, streams
+// with a preset dictionary never are
+int32_t uzlib_inflate_sync (UZLIB_DATA *d, UZLIB_SYNC *s);
+
+// carry on from a saved sync point, call after uzlib_inflate_init, input
+// continues from the next get_bytes, from where it was at the sync point,
+// and the window is refilled from the output through the callback, which
+// works as for uzlib_inflate_set_history
+void uzlib_inflate_resume (UZLIB_DATA *d, const UZLIB_SYNC *s, void (*)(void *, uint32_t, uint8_t *, uint32_t));
+
+// one shot api, decompresses the whole stream in one call
 int32_t uzlib_inflate (uint32_t (*)(void *), void (*)(void *, uint8_t *, uint32_t), void *cb_data, uint8_t *);
 
 // Checksum API
 // crc is previous value for incremental computation, 0xffffffff initially
 // and finally xor with 0xffffffff
 uint32_t uzlib_crc32(const uint8_t *data, uint32_t length, uint32_t crc);
+// adler is previous value for incremental computation, 1 initially
+uint32_t uzlib_adler32(const uint8_t *data, uint32_t length, uint32_t adler);
+
+// crc32 table options, trading ram for speed
+// UZLIB_CRC32_NIBBLE - 16 entry table, 64 bytes (initialised data)
+//                      two table lookups per byte
+// UZLIB_CRC32_BYTE   - 256 entry table, 1k of ram
+//                      one table lookup per byte
+// UZLIB_CRC32_SLICE4 - 4 x 256 entry tables, 4k of ram
+//                      slice-by-4, a word per step
+// UZLIB_CRC32_SLICE8 - 8 x 256 entry tables, 8k of ram
+//                      slice-by-8, two words per step
+// the sliced versions only work a word at a time on aligned data, so
+// callers should pass word aligned buffers
+#define UZLIB_CRC32_NIBBLE 0
+#define UZLIB_CRC32_BYTE   1
+#define UZLIB_CRC32_SLICE4 4
+#define UZLIB_CRC32_SLICE8 8
+
+// override on the compiler command line to change
+#ifndef UZLIB_CRC32_TABLE
+#define UZLIB_CRC32_TABLE UZLIB_CRC32_SLICE4
+#endif
 
 #endif /* UZLIB_INFLATE_H */
 
@@ -45,6 +45,10 @@
 
 #include "uzlib.h"
 
+// esp8266 built in rom functions
+extern void ets_memset(void*, uint8_t, uint32_t);
+extern void ets_memcpy(void*, const void*, uint32_t);
+
 #ifdef DEBUG_COUNTS
 #define DBG_PRINT(...) printf(__VA_ARGS__)
 #define DBG_COUNT(n) (debugCounts[n]++)
@@ -59,60 +63,27 @@ int32_t debugCounts[20];
 
 
 #define SIZE(arr) (sizeof(arr) / sizeof(*(arr)))
+#define MIN(a,b) (a<b ? a:b)
 
 int32_t dbg_break(void) {return 1;}
 
-/* data structures */
-
-typedef struct {
-   uint16_t table[16];  /* table of code length counts */
-   uint16_t trans[288]; /* code -> symbol translation table */
-} UZLIB_TREE;
-
-typedef struct {
-	uint8_t decomp_buffer[32*1024];
-	uint32_t decomp_pos;
-
-	uint8_t *source;
-	uint32_t source_len;
-	uint32_t source_pos;
- /*
-  * extra bits and base tables for length and distance codes
-  */
-  uint8_t  lengthBits[30];
-  uint16_t lengthBase[30];
-  uint8_t  distBits[30];
-  uint16_t distBase[30];
- /*
-  * special ordering of code length codes
-  */
-  uint8_t  clcidx[19];
- /*
-  * dynamic length/symbol and distance trees
-  */
-  UZLIB_TREE ltree;
-  UZLIB_TREE dtree;
- /*
-  * methods encapsulate handling of the input and output streams
-  */
-  void (*put_bytes)(void*, uint8_t*, uint);
-  uint32_t (*get_bytes)(void*);
-  // user data passed to callbacks
-  void *cb_data;
- /*
-  * Other state values
-  */
-  uint32_t tag;
-  uint32_t bitcount;
-  uint32_t lzOffs;
-  int32_t  bType;
-  int32_t  bFinal;
-  uint32_t curLen;
-  uint32_t dest_len;
-  uint32_t checksum;
-} UZLIB_DATA;
-
+/*
+ * Huffman codes up to FAST_BITS long are decoded with a single lookup in
+ * the fast table (see UZLIB_TREE), indexed by the next FAST_BITS bits of
+ * the stream. Each entry holds the code length in the top bits and the
+ * symbol in the low 9 bits, a zero entry means the code is longer (or
+ * invalid) and is decoded by walking the canonical code.
+ */
+#define FAST_BITS UZLIB_FAST_BITS
+#define FAST_SYM(e) ((e) & 0x1ff)
+#define FAST_LEN(e) ((e) >> 9)
 
+/*
+ * crc32, using the table size selected by UZLIB_CRC32_TABLE (see uzlib.h).
+ * The 256 entry tables are generated on first use, rather than being
+ * initialised data, so they only cost ram and not space in the image.
+ */
+#if UZLIB_CRC32_TABLE == UZLIB_CRC32_NIBBLE
 
 static const uint32_t tinf_crc32tab[16] = {
    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190,
@@ -134,24 +105,150 @@ uint32_t uzlib_crc32(const uint8_t *data, uint32_t len, uint32_t crc)
    return crc;
 }
 
+#else
+
+#if UZLIB_CRC32_TABLE == UZLIB_CRC32_BYTE
+#define CRC32_SLICES 1
+#elif UZLIB_CRC32_TABLE == UZLIB_CRC32_SLICE4
+#define CRC32_SLICES 4
+#elif UZLIB_CRC32_TABLE == UZLIB_CRC32_SLICE8
+#define CRC32_SLICES 8
+#else
+#error Unknown UZLIB_CRC32_TABLE
+#endif
+
+static uint32_t tinf_crc32tab[CRC32_SLICES][256];
+static uint8_t tinf_crc32tab_built;
+
+static void build_crc32_tables (void) {
+   uint32_t i, j, crc;
+
+   /* standard byte at a time table */
+   for (i = 0; i < 256; ++i) {
+      crc = i;
+      for (j = 0; j < 8; ++j)
+         crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+      tinf_crc32tab[0][i] = crc;
+   }
+
+   /* each further table advances the crc of the previous one by a byte */
+   for (j = 1; j < CRC32_SLICES; ++j) {
+      for (i = 0; i < 256; ++i) {
+         crc = tinf_crc32tab[j - 1][i];
+         tinf_crc32tab[j][i] = (crc >> 8) ^ tinf_crc32tab[0][crc & 0xff];
+      }
+   }
+
+   tinf_crc32tab_built = 1;
+}
+
+#define CRC32_BYTE(crc, b) \
+   ((crc) = tinf_crc32tab[0][((crc) ^ (b)) & 0xff] ^ ((crc) >> 8))
+
+uint32_t uzlib_crc32(const uint8_t *data, uint32_t len, uint32_t crc)
+{
+   if (!tinf_crc32tab_built)
+      build_crc32_tables();
+
+#if CRC32_SLICES > 1
+   /* single bytes up to a word boundary */
+   while (len && ((uintptr_t)data & 3)) {
+      CRC32_BYTE(crc, *data++);
+      len--;
+   }
+
+   /* then whole aligned words */
+   while (len >= CRC32_SLICES) {
+      uint32_t one = *(const uint32_t *)data ^ crc;
+#if CRC32_SLICES == 8
+      uint32_t two = *(const uint32_t *)(data + 4);
+      crc = tinf_crc32tab[7][one & 0xff] ^
+            tinf_crc32tab[6][(one >> 8) & 0xff] ^
+            tinf_crc32tab[5][(one >> 16) & 0xff] ^
+            tinf_crc32tab[4][one >> 24] ^
+            tinf_crc32tab[3][two & 0xff] ^
+            tinf_crc32tab[2][(two >> 8) & 0xff] ^
+            tinf_crc32tab[1][(two >> 16) & 0xff] ^
+            tinf_crc32tab[0][two >> 24];
+#else
+      crc = tinf_crc32tab[3][one & 0xff] ^
+            tinf_crc32tab[2][(one >> 8) & 0xff] ^
+            tinf_crc32tab[1][(one >> 16) & 0xff] ^
+            tinf_crc32tab[0][one >> 24];
+#endif
+      data += CRC32_SLICES;
+      len -= CRC32_SLICES;
+   }
+#endif
+
+   /* and any bytes left over */
+   while (len--)
+      CRC32_BYTE(crc, *data++);
+
+   return crc;
+}
+
+#endif
+
+/*
+ * adler32, used by zlib streams, and to identify preset dictionaries.
+ */
+#define ADLER32_BASE 65521
+/* largest n such that 255n(n+1)/2 + (n+1)(BASE-1) fits in 32 bits */
+#define ADLER32_NMAX 5552
+
+uint32_t uzlib_adler32(const uint8_t *data, uint32_t len, uint32_t adler)
+{
+   uint32_t s1 = adler & 0xffff;
+   uint32_t s2 = adler >> 16;
+
+   while (len > 0) {
+      uint32_t k = MIN(len, ADLER32_NMAX);
+      len -= k;
+      while (k--) {
+         s1 += *data++;
+         s2 += s1;
+      }
+      s1 %= ADLER32_BASE;
+      s2 %= ADLER32_BASE;
+   }
+
+   return (s2 << 16) | s1;
+}
+
 static uint8_t get_byte(UZLIB_DATA *d) {
 	if (d->source_pos >= d->source_len) {
 		d->source_len = d->get_bytes(d->cb_data);
 		d->source_pos = 0;
+		if (d->source_len == 0) {
+			// out of input, flag the stream as truncated
+			d->input_end = 1;
+			return 0;
+		}
 	}
 	//ets_printf("get 0x%02x\n", d->source[d->source_pos]);
 	return d->source[d->source_pos++];
 }
 
-static void push_bytes(UZLIB_DATA *d) {
-	// write out the buffer
-	put_bytes(d->cb_data, d->decomp_buffer, d->decomp_pos);
+static void flush_bytes(UZLIB_DATA *d) {
+	// write out the buffer, skipping any preset dictionary, or
+	// output already written at a sync point
+	uint8_t *data = d->decomp_buffer + d->flush_pos;
+	uint32_t len = d->decomp_pos - d->flush_pos;
+	d->put_bytes(d->cb_data, data, len);
 	// update checksum
-	d->checksum = uzlib_crc32(d->decomp_buffer, d->decomp_pos, d->checksum);
-	// update length
+	if (d->zlib) d->checksum = uzlib_adler32(data, len, d->checksum);
+	else d->checksum = uzlib_crc32(data, len, d->checksum);
+	d->flush_pos = d->decomp_pos;
+}
+
+static void push_bytes(UZLIB_DATA *d) {
+	flush_bytes(d);
+	// update length, this includes the dictionary
 	d->dest_len += d->decomp_pos;
 	// circle back to start
 	d->decomp_pos = 0;
+	d->flush_pos = 0;
 }
 
 static void put_byte(UZLIB_DATA *d, uint8_t data) {
@@ -162,8 +259,25 @@ static void put_byte(UZLIB_DATA *d, uint8_t data) {
 	d->decomp_buffer[d->decomp_pos++] = data;
 }
 
+/* byte at output position pos, older than the window, via the history cache */
+static uint8_t history_byte(UZLIB_DATA *d, uint32_t pos) {
+	uint32_t line = pos & ~(uint32_t)(sizeof(d->hist_cache) - 1);
+	if (line != d->hist_pos) {
+		d->get_history(d->cb_data, line, d->hist_cache, sizeof(d->hist_cache));
+		d->hist_pos = line;
+	}
+	return d->hist_cache[pos - line];
+}
+
+/* largest back reference that can be served */
+static uint32_t max_dist(UZLIB_DATA *d) {
+	return d->get_history ? UZLIB_MAX_DIST : sizeof(d->decomp_buffer);
+}
+
 static uint8_t recall_byte(UZLIB_DATA *d, uint32_t offset) {
-	if (offset <= d->decomp_pos) {
+	if (offset > sizeof(d->decomp_buffer)) {
+		return history_byte(d, d->dest_len + d->decomp_pos - offset);
+	} else if (offset <= d->decomp_pos) {
 		//ets_printf("recall1 0x%08x from 0x%08x (0x%08x), 0x%02x (%c)\n", offset, decomp_pos, decomp_pos-offset, decomp_buffer[decomp_pos-offset], decomp_buffer[decomp_pos-offset]);
 		return d->decomp_buffer[d->decomp_pos-offset];
 	} else {
@@ -194,50 +308,88 @@ static void skip_bytes(UZLIB_DATA *d, int32_t num) {
     while (get_byte(d)) {}
 }
 
-static uint16_t get_uint16(UZLIB_DATA *d) {
-  uint16_t v = get_byte(d);
-  return v | (get_byte(d) << 8);
+/*
+ * The bit buffer (tag) holds up to 32 bits, lsb first. When at least 4
+ * bytes are left in the source buffer it is topped up by a whole word
+ * (assembled from bytes, the lx106 can't do unaligned loads) leaving 24
+ * to 31 valid bits. Any bits above bitcount are then the real bits of
+ * the next byte, which get re-read, so or-ing them in again is harmless.
+ * Near the end of the source buffer it falls back to a byte at a time.
+ */
+#define LOAD_LE32(p) \
+  ((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+/* top up the bit buffer to hold at least num bits */
+static void fill_bits (UZLIB_DATA *d, uint32_t num) {
+  if (d->source_len - d->source_pos >= 4) {
+    d->tag |= LOAD_LE32(d->source + d->source_pos) << d->bitcount;
+    d->source_pos += (31 - d->bitcount) >> 3;
+    d->bitcount |= 24;
+  } else {
+    while (d->bitcount < num) {
+      d->tag |= ((uint32_t)get_byte(d)) << d->bitcount;
+      d->bitcount += 8;
+    }
+  }
 }
 
-static uint32_t get_le_uint32 (UZLIB_DATA *d) {
-  uint32_t v = get_uint16(d);
-  return  v | ((uint) get_uint16(d) << 16);
+/* look at the next num bits of the stream, without consuming them */
+static uint32_t peek_bits (UZLIB_DATA *d, uint32_t num) {
+  if (d->bitcount < num)
+    fill_bits(d, num);
+  return d->tag & ~(((uint32_t)-1)<<num);
+}
+
+/* consume num bits, previously examined with peek_bits */
+static void drop_bits (UZLIB_DATA *d, uint32_t num) {
+  d->tag >>= num;
+  d->bitcount -= num;
 }
 
 /* get one bit from source stream */
 static int32_t getbit (UZLIB_DATA *d) {
-  uint32_t bit;
-
-  /* check if tag is empty */
-  if (!d->bitcount--) {
-    /* load next tag */
-    d->tag = get_byte(d);
-    d->bitcount = 7;
-  }
-
-  /* shift bit out of tag */
-  bit = d->tag & 0x01;
-  d->tag >>= 1;
-
+  uint32_t bit = peek_bits(d, 1);
+  drop_bits(d, 1);
   return bit;
 }
 
 /* read a num bit value from a stream and add base */
 static uint32_t read_bits (UZLIB_DATA *d, int32_t num, int32_t base) {
- /* This is an optimised version which doesn't call getbit num times */
+  uint32_t n;
+
   if (!num)
     return base;
 
-  uint32_t i, n = (((uint)-1)<<num);
-  for (i = d->bitcount; i < num; i +=8)
-    d->tag |= ((uint)get_byte(d)) << i;
-
-  n = d->tag & ~n;
-  d->tag >>= num;
-  d->bitcount = i - num;
+  n = peek_bits(d, num);
+  drop_bits(d, num);
   return base + n;
 }
 
+/* discard any bits left before the next byte boundary */
+static void align_bits (UZLIB_DATA *d) {
+  drop_bits(d, d->bitcount & 7);
+}
+
+/* get a byte from a byte aligned stream, bytes already read */
+/* ahead into the bit buffer are returned first */
+static uint8_t get_aligned_byte (UZLIB_DATA *d) {
+  if (d->bitcount)
+    return read_bits(d, 8, 0);
+  /* bit buffer is empty, clear any bits read ahead */
+  d->tag = 0;
+  return get_byte(d);
+}
+
+static uint16_t get_uint16(UZLIB_DATA *d) {
+  uint16_t v = get_aligned_byte(d);
+  return v | (get_aligned_byte(d) << 8);
+}
+
+static uint32_t get_le_uint32 (UZLIB_DATA *d) {
+  uint32_t v = get_uint16(d);
+  return  v | ((uint32_t) get_uint16(d) << 16);
+}
+
 /* --------------------------------------------------- *
  * -- uninitialized global data (static structures) -- *
  * --------------------------------------------------- */
@@ -278,33 +430,20 @@ static void build_bits_base (uint8_t *bits, uint16_t *base,
   }
 }
 
-/* build the fixed huffman trees */
-static void build_fixed_trees (UZLIB_TREE *lt, UZLIB_TREE *dt) {
-  int32_t i;
-
-  /* build fixed length tree */
-  for (i = 0; i < 7; ++i) lt->table[i] = 0;
-
-  lt->table[7] = 24;
-  lt->table[8] = 152;
-  lt->table[9] = 112;
-
-  for (i = 0; i < 24; ++i)  lt->trans[i] = 256 + i;
-  for (i = 0; i < 144; ++i) lt->trans[24 + i] = i;
-  for (i = 0; i < 8; ++i)   lt->trans[24 + 144 + i] = 280 + i;
-  for (i = 0; i < 112; ++i) lt->trans[24 + 144 + 8 + i] = 144 + i;
-
-  /* build fixed distance tree */
-  for (i = 0; i < 5; ++i)   dt->table[i] = 0;
-  dt->table[5] = 32;
-
-  for (i = 0; i < 32; ++i)  dt->trans[i] = i;
+/* reverse the order of the low num bits of code */
+static uint32_t reverse_bits (uint32_t code, uint32_t num) {
+  uint32_t rev = 0;
+  while (num--) {
+    rev = (rev << 1) | (code & 1);
+    code >>= 1;
+  }
+  return rev;
 }
 
 /* given an array of code lengths, build a tree */
 static void build_tree (UZLIB_TREE *t, const uint8_t *lengths, uint32_t num) {
   uint16_t offs[16];
-  uint32_t i, sum;
+  uint32_t i, sum, len, code;
 
   /* clear code length count table */
   for (i = 0; i < 16; ++i)
@@ -326,19 +465,63 @@ static void build_tree (UZLIB_TREE *t, const uint8_t *lengths, uint32_t num) {
     if (lengths[i])
       t->trans[offs[lengths[i]]++] = i;
   }
+
+  /* clear fast table, codes not filled in below use the slow path */
+  for (i = 0; i < SIZE(t->fast); ++i)
+    t->fast[i] = 0;
+
+  /* assign canonical codes in symbol order and fill the fast table, */
+  /* the stream holds codes msb first so the index is bit reversed   */
+  for (code = 0, sum = 0, len = 1; len <= FAST_BITS; ++len) {
+    for (i = 0; i < t->table[len]; ++i, ++code, ++sum) {
+      uint32_t idx = reverse_bits(code, len);
+      for (; idx < SIZE(t->fast); idx += (1 << len))
+        t->fast[idx] = (len << 9) | t->trans[sum];
+    }
+    code <<= 1;
+  }
+}
+
+/* fixed huffman trees, only built the first time they are needed */
+static UZLIB_TREE fixed_ltree;
+static UZLIB_TREE fixed_dtree;
+static uint8_t fixed_built;
+
+/* build the fixed huffman trees */
+static void build_fixed_trees (void) {
+  uint8_t lengths[288];
+  uint32_t i;
+
+  if (fixed_built)
+    return;
+
+  /* build fixed length tree */
+  for (i = 0; i < 144; ++i) lengths[i] = 8;
+  for (; i < 256; ++i)      lengths[i] = 9;
+  for (; i < 280; ++i)      lengths[i] = 7;
+  for (; i < 288; ++i)      lengths[i] = 8;
+  build_tree(&fixed_ltree, lengths, 288);
+
+  /* build fixed distance tree */
+  for (i = 0; i < 32; ++i)  lengths[i] = 5;
+  build_tree(&fixed_dtree, lengths, 32);
+
+  fixed_built = 1;
 }
 
 /* ---------------------- *
  * -- decode functions -- *
  * ---------------------- */
 
-/* given a data stream and a tree, decode a symbol */
-static int32_t decode_symbol (UZLIB_DATA *d, UZLIB_TREE *t) {
+/* decode a code too long for the fast table from the next 15 bits */
+/* of the stream, returns the symbol and length in fast table form */
+static int32_t decode_slow (const UZLIB_TREE *t, uint32_t bits) {
   int32_t sum = 0, cur = 0, len = 0;
 
   /* get more bits while code value is above sum */
   do {
-    cur = 2*cur + getbit(d);
+    cur = 2*cur + (bits & 1);
+    bits >>= 1;
 
     if (++len == SIZE(t->table))
       return UZLIB_DATA_ERROR;
@@ -352,7 +535,22 @@ static int32_t decode_symbol (UZLIB_DATA *d, UZLIB_TREE *t) {
   if (sum < 0 || sum >= SIZE(t->trans))
     return UZLIB_DATA_ERROR;
 
-  return t->trans[sum];
+  return (len << 9) | t->trans[sum];
+}
+
+/* given a data stream and a tree, decode a symbol */
+static int32_t decode_symbol (UZLIB_DATA *d, const UZLIB_TREE *t) {
+  int32_t entry = t->fast[peek_bits(d, FAST_BITS)];
+
+  /* long code, not resolved by the lookup table */
+  if (!entry) {
+    entry = decode_slow(t, peek_bits(d, SIZE(t->table) - 1));
+    if (entry < 0)
+      return entry;
+  }
+
+  drop_bits(d, FAST_LEN(entry));
+  return FAST_SYM(entry);
 }
 
 /* given a data stream, decode dynamic trees from it */
@@ -436,7 +634,7 @@ static int32_t decode_trees (UZLIB_DATA *d, UZLIB_TREE *lt, UZLIB_TREE *dt) {
  * ----------------------------- */
 
 /* given a stream and two trees, inflate a block of data */
-static int32_t inflate_block_data (UZLIB_DATA *d, UZLIB_TREE *lt, UZLIB_TREE *dt) {
+static int32_t inflate_block_data (UZLIB_DATA *d, const UZLIB_TREE *lt, const UZLIB_TREE *dt) {
   if (d->curLen == 0) {
     int32_t dist;
     int32_t sym = decode_symbol(d, lt);
@@ -454,11 +652,20 @@ static int32_t inflate_block_data (UZLIB_DATA *d, UZLIB_TREE *lt, UZLIB_TREE *dt
 
     /* substring from sliding dictionary */
     sym -= 257;
+    if (sym < 0 || sym >= SIZE(d->lengthBits))
+      return UZLIB_DATA_ERROR;
     /* possibly get more bits from length code */
     d->curLen = read_bits(d, d->lengthBits[sym], d->lengthBase[sym]);
     dist = decode_symbol(d, dt);
+    if (dist < 0 || dist >= SIZE(d->distBits))
+      return UZLIB_DATA_ERROR;
     /* possibly get more bits from distance code */
     d->lzOffs = read_bits(d, d->distBits[dist], d->distBase[dist]);
+    /* check it's within the window and the data produced so far */
+    if (d->lzOffs > max_dist(d))
+      return UZLIB_DICT_ERROR;
+    if (d->lzOffs > d->dest_len + d->decomp_pos)
+      return UZLIB_DATA_ERROR;
     DBG_PRINT("huff dict: -%u for %u\n", d->lzOffs, d->curLen);
   }
 
@@ -471,11 +678,162 @@ static int32_t inflate_block_data (UZLIB_DATA *d, UZLIB_TREE *lt, UZLIB_TREE *dt
   return UZLIB_OK;
 }
 
+/* copy len bytes of an lz77 match, from may overlap the destination */
+static void copy_match (uint8_t *out, const uint8_t *from, uint32_t len) {
+  if (from + len <= out || out + len <= from) {
+    ets_memcpy(out, from, len);
+  } else if (from + 1 == out) {
+    /* run of a single repeated byte */
+    ets_memset(out, *from, len);
+  } else {
+    /* overlapping, must be copied in order a byte at a time */
+    while (len--) *out++ = *from++;
+  }
+}
+
+/*
+ * Fast version of inflate_block_data, used while there is enough room in
+ * the output buffer for a maximum length match and enough input for the
+ * longest possible symbol, so neither needs checking per byte. Symbols are
+ * decoded in a tight loop using a local copy of the bit buffer, literals
+ * are stored directly and whole matches are block copied from the window.
+ * Returns UZLIB_OK when it runs short of room, to let the byte at a time
+ * path deal with the buffer edges.
+ */
+#define FAST_OUT_SLACK 258
+#define FAST_IN_SLACK  16
+
+#define NEED_BITS(n) \
+  if (bitcount < (n)) { \
+    tag |= LOAD_LE32(in) << bitcount; in += (31 - bitcount) >> 3; bitcount |= 24; }
+#define DROP_BITS(n) \
+  do { tag >>= (n); bitcount -= (n); } while (0)
+#define GET_BITS(n) \
+  (tag & ~(((uint32_t)-1) << (n)))
+
+static int32_t inflate_block_fast (UZLIB_DATA *d, const UZLIB_TREE *lt, const UZLIB_TREE *dt) {
+  int32_t res = UZLIB_OK;
+  uint8_t *window = d->decomp_buffer;
+  uint8_t *out, *out_end;
+  const uint8_t *in, *in_end;
+  uint32_t tag, bitcount;
+
+  /* not at a symbol boundary, or no room to run */
+  if (d->curLen != 0 ||
+      d->decomp_pos > sizeof(d->decomp_buffer) - FAST_OUT_SLACK ||
+      d->source_pos + FAST_IN_SLACK > d->source_len)
+    return UZLIB_OK;
+
+  out = window + d->decomp_pos;
+  out_end = window + sizeof(d->decomp_buffer) - FAST_OUT_SLACK;
+  in = d->source + d->source_pos;
+  in_end = d->source + d->source_len - FAST_IN_SLACK;
+  tag = d->tag;
+  bitcount = d->bitcount;
+
+  while (out <= out_end && in <= in_end) {
+    uint32_t len, dist, pos;
+    int32_t entry, sym;
+
+    /* literal/length symbol */
+    NEED_BITS(15);
+    entry = lt->fast[GET_BITS(FAST_BITS)];
+    if (!entry && (entry = decode_slow(lt, GET_BITS(15))) < 0) {
+      res = entry;
+      break;
+    }
+    DROP_BITS(FAST_LEN(entry));
+    sym = FAST_SYM(entry);
+
+    /* literal byte */
+    if (sym < 256) {
+      *out++ = sym;
+      continue;
+    }
+
+    /* end of block */
+    if (sym == 256) {
+      res = UZLIB_DONE;
+      break;
+    }
+
+    /* match length, possibly with extra bits */
+    sym -= 257;
+    if (sym >= SIZE(d->lengthBits)) {
+      res = UZLIB_DATA_ERROR;
+      break;
+    }
+    NEED_BITS(d->lengthBits[sym]);
+    len = d->lengthBase[sym] + GET_BITS(d->lengthBits[sym]);
+    DROP_BITS(d->lengthBits[sym]);
+
+    /* distance symbol, possibly with extra bits */
+    NEED_BITS(15);
+    entry = dt->fast[GET_BITS(FAST_BITS)];
+    if (!entry && (entry = decode_slow(dt, GET_BITS(15))) < 0) {
+      res = entry;
+      break;
+    }
+    DROP_BITS(FAST_LEN(entry));
+    sym = FAST_SYM(entry);
+    if (sym >= SIZE(d->distBits)) {
+      res = UZLIB_DATA_ERROR;
+      break;
+    }
+    NEED_BITS(d->distBits[sym]);
+    dist = d->distBase[sym] + GET_BITS(d->distBits[sym]);
+    DROP_BITS(d->distBits[sym]);
+
+    /* check it's within the window and the data produced so far */
+    pos = out - window;
+    if (dist > max_dist(d)) {
+      res = UZLIB_DICT_ERROR;
+      break;
+    }
+    if (dist > d->dest_len + pos) {
+      res = UZLIB_DATA_ERROR;
+      break;
+    }
+
+    /* older than the window, already passed to put_bytes, so read back */
+    if (dist > sizeof(d->decomp_buffer)) {
+      uint32_t from = d->dest_len + pos - dist;
+      while (len--) *out++ = history_byte(d, from++);
+      continue;
+    }
+
+    /* copy the match, in two parts if it wraps round the window */
+    if (dist > pos) {
+      uint32_t part = MIN(len, dist - pos);
+      copy_match(out, window + sizeof(d->decomp_buffer) - (dist - pos), part);
+      out += part;
+      len -= part;
+    }
+    if (len) {
+      copy_match(out, out - dist, len);
+      out += len;
+    }
+  }
+
+  /* write back the local state */
+  d->decomp_pos = out - window;
+  d->source_pos = in - d->source;
+  d->tag = tag;
+  d->bitcount = bitcount;
+
+  return res;
+}
+
 /* inflate an uncompressed block of data */
 static int32_t inflate_uncompressed_block (UZLIB_DATA *d) {
   if (d->curLen == 0) {
-    uint32_t length    = get_uint16(d);
-    uint32_t invlength = get_uint16(d);
+    uint32_t length, invlength;
+
+    /* stored data starts on a byte boundary */
+    align_bits(d);
+
+    length    = get_uint16(d);
+    invlength = get_uint16(d);
 
     /* check length */
     if (length != (~invlength & 0x0000ffff))
@@ -484,16 +842,40 @@ static int32_t inflate_uncompressed_block (UZLIB_DATA *d) {
     /* increment length to properly return UZLIB_DONE below, without
        producing data at the same time */
     d->curLen = length + 1;
-
-    /* make sure we start next block on a byte boundary */
-    d->bitcount = 0;
   }
 
-  if (--d->curLen == 0) {
+  if (d->curLen == 1) {
+    d->curLen = 0;
     return UZLIB_DONE;
   }
 
-  put_byte(d, get_byte(d));
+  /* bytes already read ahead into the bit buffer come first */
+  if (d->bitcount) {
+    put_byte(d, read_bits(d, 8, 0));
+    d->curLen--;
+    return UZLIB_OK;
+  }
+
+  /* then copy runs straight from the source buffer to the output */
+  /* buffer, limited by the bytes available on each side */
+  d->tag = 0;
+  if (d->source_pos >= d->source_len) {
+    d->source_len = d->get_bytes(d->cb_data);
+    d->source_pos = 0;
+    if (d->source_len == 0) {
+      d->input_end = 1;
+      return UZLIB_DATA_ERROR;
+    }
+  }
+  if (d->decomp_pos >= sizeof(d->decomp_buffer))
+    push_bytes(d);
+
+  uint32_t len = MIN(d->curLen - 1, d->source_len - d->source_pos);
+  len = MIN(len, sizeof(d->decomp_buffer) - d->decomp_pos);
+  ets_memcpy(d->decomp_buffer + d->decomp_pos, d->source + d->source_pos, len);
+  d->decomp_pos += len;
+  d->source_pos += len;
+  d->curLen -= len;
   return UZLIB_OK;
 }
 
@@ -503,8 +885,8 @@ static int32_t inflate_uncompressed_block (UZLIB_DATA *d) {
 
 static int32_t parse_gzip_header(UZLIB_DATA *d) {
 
-  /* check id bytes */
-  if (get_byte(d) != 0x1f || get_byte(d) != 0x8b)
+  /* check second id byte, the first has been read already */
+  if (get_byte(d) != 0x8b)
     return UZLIB_DATA_ERROR;
 
   if (get_byte(d) != 8) /* check method is deflate */
@@ -517,8 +899,26 @@ static int32_t parse_gzip_header(UZLIB_DATA *d) {
 
   skip_bytes(d, 6);            /* skip rest of base header of 10 bytes */
 
-  if (flg & UZLIB_FEXTRA)            /* skip extra data if present */
-     skip_bytes(d, get_uint16(d));
+  if (flg & UZLIB_FEXTRA) {          /* check extra data if present */
+    int32_t xlen = get_uint16(d);
+    while (xlen >= 4) {
+      uint8_t si1 = get_byte(d);
+      uint8_t si2 = get_byte(d);
+      uint16_t len = get_uint16(d);
+      xlen -= 4;
+      if (len > xlen)
+        return UZLIB_DATA_ERROR;
+      xlen -= len;
+      /* window size subfield, reject streams needing a bigger window */
+      if (si1 == UZLIB_XWINDOW_SI1 && si2 == UZLIB_XWINDOW_SI2 && len >= 1) {
+        if (get_byte(d) > UZLIB_WINDOW_BITS && !d->get_history)
+          return UZLIB_DICT_ERROR;
+        len--;
+      }
+      if (len) skip_bytes(d, len);
+    }
+    if (xlen) skip_bytes(d, xlen);
+  }
 
   if (flg & UZLIB_FNAME)             /* skip file name if present */
     skip_bytes(d,0);
@@ -533,14 +933,44 @@ static int32_t parse_gzip_header(UZLIB_DATA *d) {
 }
 
 
-/* inflate next byte of compressed stream */
-static int32_t uncompress_stream (UZLIB_DATA *d) {
+static int32_t parse_zlib_header(UZLIB_DATA *d, uint8_t cmf) {
+
+  uint8_t flg = get_byte(d);
+
+  /* check header checksum and method is deflate */
+  if ((cmf * 256 + flg) % 31 || (cmf & 0x0f) != 8)
+    return UZLIB_DATA_ERROR;
+
+  /* check the window fits */
+  if ((cmf >> 4) + 8 > UZLIB_WINDOW_BITS && !d->get_history)
+    return UZLIB_DICT_ERROR;
+
+  /* check the preset dictionary is the one given */
+  if (flg & UZLIB_FDICT) {
+    uint32_t dictid = (uint32_t)get_byte(d) << 24;
+    dictid |= get_byte(d) << 16;
+    dictid |= get_byte(d) << 8;
+    dictid |= get_byte(d);
+    if (!d->dict_len || dictid != d->dict_adler)
+      return UZLIB_DICT_ERROR;
+  }
+
+  d->zlib = 1;
+  d->checksum = 1;
+  return UZLIB_OK;
+}
+
+/* inflate compressed stream, until at least budget bytes */
+/* have been produced (no limit if budget is zero), or the */
+/* end of a block */
+static int32_t uncompress_stream (UZLIB_DATA *d, uint32_t budget) {
+  uint32_t target = d->dest_len + d->decomp_pos + budget;
+
   while (1) {
     int32_t res;
 
     /* start a new block */
     if (d->bType == -1) {
-      next_blk:
       /* read final block flag */
       d->bFinal = getbit(d);
       /* read block type (2 bits) */
@@ -550,7 +980,7 @@ static int32_t uncompress_stream (UZLIB_DATA *d) {
 
       if (d->bType == 1) {
         /* build fixed huffman trees */
-        build_fixed_trees(&d->ltree, &d->dtree);
+        build_fixed_trees();
       } else if (d->bType == 2) {
         /* decode trees from stream */
         res = decode_trees(d, &d->ltree, &d->dtree);
@@ -566,24 +996,39 @@ static int32_t uncompress_stream (UZLIB_DATA *d) {
       res = inflate_uncompressed_block(d);
       break;
     case 1:
+      /* decompress block with fixed huffman trees, in the fast */
+      /* loop if possible then a byte at a time near buffer edges */
+      res = inflate_block_fast(d, &fixed_ltree, &fixed_dtree);
+      if (res == UZLIB_OK)
+        res = inflate_block_data(d, &fixed_ltree, &fixed_dtree);
+      break;
     case 2:
-      /* decompress block with fixed or dynamic huffman trees.  These */
-      /* trees were decoded previously, so it's the same routine for both */
-      res = inflate_block_data(d, &d->ltree, &d->dtree);
+      /* decompress block with dynamic huffman trees, decoded previously */
+      res = inflate_block_fast(d, &d->ltree, &d->dtree);
+      if (res == UZLIB_OK)
+        res = inflate_block_data(d, &d->ltree, &d->dtree);
       break;
     default:
       return UZLIB_DATA_ERROR;
     }
 
     if (res == UZLIB_DONE && !d->bFinal) {
-      /* the block has ended (without producing more data), but we
-         can't return without data, so start procesing next block */
-      goto next_blk;
+      /* the block has ended, end the step here, between blocks, where */
+      /* the state is small enough to save (see uzlib_inflate_sync) */
+      d->bType = -1;
+      return UZLIB_OK;
     }
 
     if (res != UZLIB_OK)
       return res;
 
+    /* ran out of input part way through the stream */
+    if (d->input_end)
+      return UZLIB_DATA_ERROR;
+
+    /* produced enough for this step */
+    if (budget && d->dest_len + d->decomp_pos >= target)
+      return UZLIB_OK;
   }
 
   return UZLIB_OK;
@@ -604,10 +1049,11 @@ static int32_t uncompress_stream (UZLIB_DATA *d) {
  *
  *   uint32_t get_bytes(void *cb_data)
  *     asks the user application to fill the (user supplied) buffer
- *     with data and return the length of data in the buffer
+ *     with data and return the length of data in the buffer, a return
+ *     of zero means there is no more input
  *   void put_bytes(void *cb_data, uint8_t *decompressed_data, uint32_t length)
- *     passes decompressed data to the user application when the 32k
- *     output buffer is full and (less) when end of file is reached
+ *     passes decompressed data to the user application when the window
+ *     sized output buffer is full and (less) when end of file is reached
  * 
  *  Both callbacks pass a user supplied pointer to which the user can
  *  attach a structure to keep track of their source buffer and any
@@ -615,63 +1061,225 @@ static int32_t uncompress_stream (UZLIB_DATA *d) {
  *  A pointer to the source buffer neds to be passed in to uzlib_inflate
  *  but it does not need to contain data (or specify a length) yet
  *  as the get_bytes callback will be called straight away.
+ *
+ *  The state is owned by the caller, so several streams can be in
+ *  progress at once. Call uzlib_inflate_init, then uzlib_inflate_step
+ *  until it returns something other than UZLIB_OK (the caller is free
+ *  to do other work between steps), then uzlib_inflate_finish once it
+ *  returns UZLIB_DONE.
  */
-int32_t uzlib_inflate (
+void uzlib_inflate_init (
+     UZLIB_DATA *d,
      uint32_t (*get_bytes)(void*),
-     void (*put_bytes)(void *, uint8_t *, uint),
+     void (*put_bytes)(void *, uint8_t *, uint32_t),
 	 void *cb_data,
 	 uint8_t *source) {
 
-  int32_t res;
-
-  // decompression structure - includes a large output buffer so must be declared
-  // static, or the memory doesn't get allocated properly!
-  static UZLIB_DATA d;
-
   // initialize decompression structure
-  d.bitcount    = 0;
-  d.bFinal      = 0;
-  d.bType       = -1;
-  d.curLen      = 0;
-  d.dest_len    = 0;
-  d.get_bytes   = get_bytes;
-  d.put_bytes   = put_bytes;
-  d.cb_data	    = cb_data;
-  d.source      = source;
-  d.source_len  = 0;
-  d.source_pos  = 0;
-  d.decomp_pos  = 0;
-  d.checksum    = 0xffffffff;
+  d->get_bytes   = get_bytes;
+  d->put_bytes   = put_bytes;
+  d->cb_data     = cb_data;
+  d->source      = source;
+  d->source_len  = 0;
+  d->source_pos  = 0;
+  d->input_end   = 0;
+  d->get_history = 0;
+  uzlib_inflate_next(d);
 
   // create RAM copy of clcidx byte array
-  ets_memcpy(d.clcidx, CLCIDX_INIT, sizeof(d.clcidx));
+  ets_memcpy(d->clcidx, CLCIDX_INIT, sizeof(d->clcidx));
 
   // build extra bits and base tables
-  build_bits_base(d.lengthBits, d.lengthBase, 4, 3);
-  build_bits_base(d.distBits, d.distBase, 2, 1);
-  d.lengthBits[28] = 0;              // fix a special case
-  d.lengthBase[28] = 258;
-
-  // do the decompression
-  if ((res = parse_gzip_header(&d)) != UZLIB_OK) return res;
-  while ((res = uncompress_stream(&d)) == UZLIB_OK) {}
-  if (res != UZLIB_DONE) return res;
+  build_bits_base(d->lengthBits, d->lengthBase, 4, 3);
+  build_bits_base(d->distBits, d->distBase, 2, 1);
+  d->lengthBits[28] = 0;              // fix a special case
+  d->lengthBase[28] = 258;
+}
+
+/*
+ * Reset the decompression state to decode another stream that follows
+ * the current one in the input, keeping any input already read.
+ */
+void uzlib_inflate_next (UZLIB_DATA *d) {
+  d->bitcount    = 0;
+  d->tag         = 0;
+  d->bFinal      = 0;
+  d->bType       = -1;
+  d->curLen      = 0;
+  d->dest_len    = 0;
+  d->decomp_pos  = 0;
+  d->flush_pos   = 0;
+  d->checksum    = 0xffffffff;
+  d->header_done = 0;
+  d->zlib        = 0;
+  d->dict_len    = 0;
+  d->dict_adler  = 1;
+  d->hist_pos    = 0xffffffff;
+}
+
+/*
+ * Preset dictionary, for zlib streams, call before the first step, can
+ * be called repeatedly to add the dictionary in parts. Only the last
+ * window of it is kept, and it is not passed to put_bytes.
+ */
+void uzlib_inflate_set_dict (UZLIB_DATA *d, const uint8_t *dict, uint32_t len) {
+  d->dict_adler = uzlib_adler32(dict, len, d->dict_adler);
+  d->dict_len += len;
+  while (len > 0) {
+    uint32_t next = MIN(len, sizeof(d->decomp_buffer) - d->decomp_pos);
+    ets_memcpy(d->decomp_buffer + d->decomp_pos, dict, next);
+    d->decomp_pos += next;
+    dict += next;
+    len -= next;
+    if (d->decomp_pos == sizeof(d->decomp_buffer)) {
+      /* wrap round, without output */
+      d->dest_len += d->decomp_pos;
+      d->decomp_pos = 0;
+    }
+  }
+  d->flush_pos = d->decomp_pos;
+}
+
+/*
+ * Serve back references older than the window by reading the output
+ * back through get_history, call after uzlib_inflate_init.
+ */
+void uzlib_inflate_set_history (
+     UZLIB_DATA *d,
+     void (*get_history)(void *, uint32_t, uint8_t *, uint32_t)) {
+  d->get_history = get_history;
+  d->hist_pos    = 0xffffffff;
+}
+
+/*
+ * Sync point, between deflate blocks with everything the stream needs
+ * from before it either in the saved state or the output. The output
+ * still in the window is passed to put_bytes, but kept in the window,
+ * so decoding carries on as normal.
+ */
+int32_t uzlib_inflate_sync (UZLIB_DATA *d, UZLIB_SYNC *s) {
+  if (!d->header_done || d->bType != -1 || d->dict_len || d->input_end)
+    return -1;
+
+  if (d->decomp_pos > d->flush_pos)
+    flush_bytes(d);
+
+  s->tag        = d->tag;
+  s->bitcount   = d->bitcount;
+  s->dest_len   = d->dest_len;
+  s->decomp_pos = d->decomp_pos;
+  s->checksum   = d->checksum;
+  s->zlib       = d->zlib;
+  return d->source_len - d->source_pos;
+}
+
+/*
+ * Carry on from a sync point. The output is read back a cache line at a
+ * time to refill the window, the window is a multiple of the cache size,
+ * and dest_len a multiple of the window, so output at pos is always at
+ * pos % window in the buffer and lines never wrap round it.
+ */
+void uzlib_inflate_resume (
+     UZLIB_DATA *d,
+     const UZLIB_SYNC *s,
+     void (*get_history)(void *, uint32_t, uint8_t *, uint32_t)) {
+  uint32_t end = s->dest_len + s->decomp_pos;
+  uint32_t pos = (end > sizeof(d->decomp_buffer)) ? end - sizeof(d->decomp_buffer) : 0;
+
+  d->tag         = s->tag;
+  d->bitcount    = s->bitcount;
+  d->dest_len    = s->dest_len;
+  d->decomp_pos  = s->decomp_pos;
+  d->flush_pos   = s->decomp_pos;
+  d->checksum    = s->checksum;
+  d->zlib        = s->zlib;
+  d->header_done = 1;
+  d->source_len  = 0;
+  d->source_pos  = 0;
+
+  while (pos < end) {
+    uint32_t line = pos & ~(uint32_t)(sizeof(d->hist_cache) - 1);
+    uint32_t len = MIN(end - pos, line + sizeof(d->hist_cache) - pos);
+    get_history(d->cb_data, line, d->hist_cache, sizeof(d->hist_cache));
+    ets_memcpy(d->decomp_buffer + (pos % sizeof(d->decomp_buffer)), d->hist_cache + (pos - line), len);
+    pos += len;
+  }
+  d->hist_pos = 0xffffffff;
+}
+
+/*
+ * Decompress until at least budget bytes of output have been produced
+ * (zero for no limit), the end of a deflate block, or the input runs
+ * out. Returns UZLIB_OK if there is more to do, UZLIB_DONE at the end of
+ * the compressed data, or an error. Output is still passed to put_bytes
+ * a buffer at a time, so the budget just sets how often control comes
+ * back to the caller.
+ */
+int32_t uzlib_inflate_step (UZLIB_DATA *d, uint32_t budget) {
+
+  int32_t res;
+
+  if (!d->header_done) {
+    /* gzip or zlib, from the first byte */
+    uint8_t id = get_byte(d);
+    res = (id == 0x1f) ? parse_gzip_header(d) : parse_zlib_header(d, id);
+    if (res != UZLIB_OK) return res;
+    if (d->input_end) return UZLIB_DATA_ERROR;
+    d->header_done = 1;
+  }
+
+  return uncompress_stream(d, budget);
+}
+
+/*
+ * Flush any remaining output and check the gzip footer, call after
+ * uzlib_inflate_step has returned UZLIB_DONE.
+ */
+int32_t uzlib_inflate_finish (UZLIB_DATA *d) {
+
+  uint32_t checksum, length;
 
   // flush remaining output from buffer
-  if (d.decomp_pos > 0) push_bytes(&d);
-  
-  // check checksum and length
-  d.checksum ^= 0xffffffff;
-  if (get_le_uint32(&d) != d.checksum) return UZLIB_CHKSUM_ERROR;
-  if (get_le_uint32(&d) != d.dest_len) return UZLIB_LENGTH_ERROR;
-  /*uint32_t checksum = get_le_uint32(&d);
-  uint32_t length =  get_le_uint32(&d);
-  ets_printf("crc in file 0x%08x, calculated 0x%08x\n", checksum, d.checksum);
-  ets_printf("len in file 0x%08x, calculated 0x%08x\n", length, d.dest_len);
-  if (checksum != d.checksum) return UZLIB_CHKSUM_ERROR;
-  if (length != d.dest_len) return UZLIB_LENGTH_ERROR;*/
+  if (d->decomp_pos > 0) push_bytes(d);
+
+  // check checksum and length, footer starts on a byte boundary
+  align_bits(d);
+  if (d->zlib) {
+    // zlib has just a big endian adler32
+    checksum = (uint32_t)get_aligned_byte(d) << 24;
+    checksum |= get_aligned_byte(d) << 16;
+    checksum |= get_aligned_byte(d) << 8;
+    checksum |= get_aligned_byte(d);
+    if (d->input_end) return UZLIB_DATA_ERROR;
+    if (checksum != d->checksum) return UZLIB_CHKSUM_ERROR;
+    return UZLIB_DONE;
+  }
+  checksum = get_le_uint32(d);
+  length = get_le_uint32(d);
+  if (d->input_end) return UZLIB_DATA_ERROR;
+  if (checksum != (d->checksum ^ 0xffffffff)) return UZLIB_CHKSUM_ERROR;
+  if (length != d->dest_len - d->dict_len) return UZLIB_LENGTH_ERROR;
 
   return UZLIB_DONE;
-  
 }
 
+/*
+ * Decompress a whole stream in one call, using internal state.
+ */
+int32_t uzlib_inflate (
+     uint32_t (*get_bytes)(void*),
+     void (*put_bytes)(void *, uint8_t *, uint32_t),
+	 void *cb_data,
+	 uint8_t *source) {
+
+  int32_t res;
+
+  // decompression structure - includes a large output buffer so must be declared
+  // static, or the memory doesn't get allocated properly!
+  static UZLIB_DATA d;
+
+  uzlib_inflate_init(&d, get_bytes, put_bytes, cb_data, source);
+  while ((res = uzlib_inflate_step(&d, 0)) == UZLIB_OK) {}
+  if (res != UZLIB_DONE) return res;
+  return uzlib_inflate_finish(&d);
+}